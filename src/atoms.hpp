@@ -51,9 +51,17 @@ struct HParam {
 	bool tppsigma_on = false;
 	double SO[3]{0}, CF[5]{0};
 	double SC2[5]{0}, SC1[3]{0}, FG[4]{0}, SC2EX[5]{0};
-	int gs_diag_option = 2, ex_diag_option = 2;
+	int gs_diag_option = 0, ex_diag_option = 0; // 0: chosen per block by the cost planner
 	bool block_diag = true, HYB = true, effective_delta = true;
+	bool k_block = false, pg_block = false; // Translation (momentum) and point group blocks
+	bool sz_flip = false; // Only diagonalize Sz >= 0 blocks, Sz < 0 blocks are spin flipped
+	double s_target = -1, s_penalty = 200; // Only diagonalize Sz = S block, penalty on higher spin
 	bool print_site_occ = false;
+	bool par_diag = false; // Diagonalize dense blocks concurrently
+	bool diag_range = false; // Dense blocks only solve the lowest NEV eigenpairs, or the AB window
+	bool warm_start = false; // Iterative solvers start from eigenvectors saved by the last run
+	double eig_trunc = 0; // Eigenvector coefficients |c| <= eig_trunc are dropped, 0: kept dense
+	bool eig_float = false; // Eigenvectors are kept in single precision
 	int ex_nev = 0, gs_nev = 0;
 	std::vector<double*> SC;
 	HParam() {
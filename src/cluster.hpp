@@ -28,6 +28,7 @@ public:
 	void print_eigstate(const vecd& occ, bool is_print = true, std::string fname = "", int p = 5);
 	vecc get_inp_tmat();
 	vecd get_tmat_real();
+	vecc get_ylm2real_mat(int l) {return l == 2 ? U_d() : l == 1 ? U_p() : U_s();};
 protected:
 	int w = 12, num_sites = 1;
 	std::vector<std::string> orb_names;
@@ -42,20 +42,22 @@ void ed_dsyev(double* _mat, double* _eigval, size_t n) {
 	return;
 }
 
-void ed_dsyevr(double* _mat, double *_eigvec, double* _eigval, size_t n) {
-	MKL_INT N = n, il, iu, info, lwork = -1, liwork = -1, iwkopt;
-	double abstol = -1.0, vl, vu, wkopt;
+size_t ed_dsyevr(double* _mat, double *_eigvec, double* _eigval, size_t n, char range, 
+					double vl, double vu, size_t il_in, size_t iu_in) {
+	MKL_INT N = n, il = il_in, iu = iu_in, M = 0, info, lwork = -1, liwork = -1, iwkopt;
+	double abstol = -1.0, wkopt;
 	double* work;
 	MKL_INT* iwork;
 	MKL_INT* isuppz = new MKL_INT[2*N];
-	dsyevr("Vectors","All","Upper",&N,_mat,&N,&vl,&vu,&il,&iu,&abstol,&N,
+	char JOBZ = 'V', UPLO = 'U';
+	dsyevr(&JOBZ,&range,&UPLO,&N,_mat,&N,&vl,&vu,&il,&iu,&abstol,&M,
 			_eigval,_eigvec,&N,isuppz,&wkopt,&lwork,&iwkopt,&liwork,&info);
 	lwork = (MKL_INT)wkopt;
 	work = (double*)malloc(lwork*sizeof(double));
 	liwork = iwkopt;
 	iwork = (MKL_INT*)malloc(liwork*sizeof(MKL_INT));
 	N = n; // I'm not sure why I have to do this
-	dsyevr("Vectors","All","Upper",&N,_mat,&N,&vl,&vu,&il,&iu,&abstol,&N,
+	dsyevr(&JOBZ,&range,&UPLO,&N,_mat,&N,&vl,&vu,&il,&iu,&abstol,&M,
 			_eigval,_eigvec,&N,isuppz,work,&lwork,iwork,&liwork,&info);
 	try {
 		if (info!=0) throw runtime_error( "Error: dsyevr returned error code ");
@@ -63,7 +65,7 @@ void ed_dsyevr(double* _mat, double *_eigvec, double* _eigval, size_t n) {
 	delete [] work;
 	delete [] iwork;
 	delete [] isuppz;
-	return;
+	return M;
 }
 
 #else
@@ -116,11 +118,13 @@ void ed_dsyev(double* _mat, double* _eigval, size_t n) {
 	return;
 }
 
-void ed_dsyevr(double* _mat, double *_eigvec, double* _eigval, size_t n) {
+size_t ed_dsyevr(double* _mat, double *_eigvec, double* _eigval, size_t n, char Range, 
+					double vl, double vu, size_t il_in, size_t iu_in) {
+	// Range 'A': all eigenpairs, 'I': il-th to iu-th (from 1), 'V': eigenvalues in (vl,vu]
 	int N = n, LDA = n, LDZ = n, M = n;
-	int il, iu, info, lwork = -1, liwork = -1, iwkopt;
-	char JOBZ = 'V', Range = 'A', UPLO = 'U';
-	double abstol = -1.0, vl, vu, wkopt;
+	int il = il_in, iu = iu_in, info, lwork = -1, liwork = -1, iwkopt;
+	char JOBZ = 'V', UPLO = 'U';
+	double abstol = -1.0, wkopt;
 	double* work;
 	int* iwork;
 	int* isuppz = new int[2*N];
@@ -141,7 +145,7 @@ void ed_dsyevr(double* _mat, double *_eigvec, double* _eigval, size_t n) {
 	delete [] work;
 	delete [] iwork;
 	delete [] isuppz;
-	return;
+	return M;
 }
 
 #endif
@@ -1,7 +1,10 @@
 #ifndef DIAGONALIZE
 #define DIAGONALIZE
 #include "matrix.hpp"
-// #include <omp.h> # I don't think I use these
+#include <random>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #if defined __has_include && __has_include (<arpack/arpack.hpp>) 
 #if __APPLE__  //Disable some warning from MacOS
 #pragma GCC diagnostic push
@@ -25,12 +28,14 @@
 
 void ed_dgees(double *_mat, double *_eigvec, double* _eigReal, size_t n);
 void ed_dsyev(double *_mat, double *_eigval, size_t n);
-void ed_dsyevr(double *_mat, double *_eigvec, double* _eigReal, size_t n);
+size_t ed_dsyevr(double *_mat, double *_eigvec, double* _eigReal, size_t n, char range = 'A', 
+					double vl = 0, double vu = 0, size_t il = 1, size_t iu = 1);
 
 #ifdef __ARPACK_HPP__
 #define ARPACK_TOL 1e-10
 template <typename Real> 
-void ed_dsarpack(Matrix<Real>* ham, Real *_eigvec, Real* _eigval, size_t n, size_t _nev) {
+void ed_dsarpack(Matrix<Real>* ham, Real *_eigvec, Real* _eigval, size_t n, size_t _nev,
+				 const std::vector<Real>& guess = std::vector<Real>()) {
 	const a_uint N      = n;
 	const a_uint nev    = (_nev < N) ? _nev : N;
 	const a_uint ncv    = std::min(2*nev+1,N); // NCV size could be increased??
@@ -55,6 +60,12 @@ void ed_dsarpack(Matrix<Real>* ham, Real *_eigvec, Real* _eigval, size_t n, size
 	iparam[6] = 1;      // mode
 
 	a_int info = 0, ido = 0;
+	if (!guess.empty()) {
+		// Start from the sum of the guess vectors instead of a random residual
+		std::fill(resid,resid+N,0);
+		for (size_t i = 0; i < guess.size(); ++i) resid[i%N] += guess[i];
+		info = 1;
+	}
 	do {
 		arpack::saupd(ido, arpack::bmat::identity, N, arpack::which::smallest_algebraic, 
 						nev, tol, resid, ncv, V, ldv, iparam, ipntr, workd, 
@@ -84,35 +95,586 @@ void ed_dsarpack(Matrix<Real>* ham, Real *_eigvec, Real* _eigval, size_t n, size
 }
 #else
 template <typename Real> 
-void ed_dsarpack(Matrix<Real>* ham, Real *_eigvec, Real* _eigval, size_t n, size_t& nev) {
+void ed_dsarpack(Matrix<Real>* ham, Real *_eigvec, Real* _eigval, size_t n, size_t& nev,
+				 const std::vector<Real>& guess = std::vector<Real>()) {
+	// _eigvec holds n*nev, only the lowest nev eigenpairs are solved for
 	std::cout << "Arpack not available, switching to mkl/lapack" << std::endl;
-	nev = n;
+	nev = std::min(nev,n);
+	std::vector<double> w(n);
 	auto _ham = ham->get_dense();
-	ed_dsyevr(_ham,_eigvec,_eigval,n);
+	nev = ed_dsyevr(_ham,_eigvec,w.data(),n,'I',0,0,1,nev);
+	std::copy(w.begin(),w.begin()+nev,_eigval);
 	delete [] _ham;
 	_ham = nullptr;
 	return;
 };
 #endif
 
+#define CHFSI_TOL 1e-9
+#define CHFSI_SLICE 200
+#define CHFSI_WEIGHT 0.25
+#define CHFSI_DENSE 0.3
+template <typename Real>
+void spectral_bounds(Matrix<Real>* ham, size_t n, double& lo, double& hi, int niter = 60) {
+	// Short Lanczos run, extreme Ritz values widened by the last beta bound the spectrum
+	int m = std::min(size_t(niter),n);
+	std::vector<Real> v(n,0), vl(n,0), w(n,0), tri(m*m,0), tvec(m*m,0), tval(m,0);
+	for (size_t i = 0; i < n; ++i) v[i] = 1.0/std::sqrt(double(n))*((i%7)+1)/4.0;
+	double nrm = 0, beta = 0;
+	for (auto& x : v) nrm += x*x;
+	for (auto& x : v) x /= std::sqrt(nrm);
+	for (int i = 0; i < m; ++i) {
+		ham->mvmult(v.data(),w.data(),n);
+		double alpha = 0;
+		#pragma omp parallel for reduction(+:alpha)
+		for (size_t j = 0; j < n; ++j) alpha += v[j]*w[j];
+		tri[i*m+i] = alpha;
+		#pragma omp parallel for
+		for (size_t j = 0; j < n; ++j) w[j] -= alpha*v[j] + beta*vl[j];
+		beta = 0;
+		#pragma omp parallel for reduction(+:beta)
+		for (size_t j = 0; j < n; ++j) beta += w[j]*w[j];
+		beta = std::sqrt(beta);
+		if (beta < 1e-12 || i == m-1) {
+			m = i+1;
+			break;
+		}
+		tri[i*m+i+1] = tri[(i+1)*m+i] = beta;
+		std::swap(vl,v);
+		#pragma omp parallel for
+		for (size_t j = 0; j < n; ++j) v[j] = w[j]/beta;
+	}
+	std::vector<Real> sub(m*m,0);
+	for (int i = 0; i < m; ++i) for (int j = 0; j < m; ++j) sub[i*m+j] = tri[i*tval.size()+j];
+	ed_dsyevr(sub.data(),tvec.data(),tval.data(),m);
+	lo = tval[0] - beta - 1e-3;
+	hi = tval[m-1] + beta + 1e-3;
+	return;
+}
+
+template <typename Real>
+void cheb_filter(Matrix<Real>* ham, const std::vector<double>& mu, double c, double e, 
+				 const Real* x, Real* y, size_t n) {
+	// y = sum_k mu_k T_k((H-c)/e) x
+	std::vector<Real> t0(x,x+n), t1(n,0), t2(n,0);
+	ham->mvmult(t0.data(),t1.data(),n);
+	#pragma omp parallel for
+	for (size_t j = 0; j < n; ++j) {
+		t1[j] = (t1[j]-c*t0[j])/e;
+		y[j] = mu[0]*t0[j] + mu[1]*t1[j];
+	}
+	for (size_t k = 2; k < mu.size(); ++k) {
+		ham->mvmult(t1.data(),t2.data(),n);
+		#pragma omp parallel for
+		for (size_t j = 0; j < n; ++j) {
+			t2[j] = 2*(t2[j]-c*t1[j])/e - t0[j];
+			y[j] += mu[k]*t2[j];
+		}
+		std::swap(t0,t1);
+		std::swap(t1,t2);
+	}
+	return;
+}
+
+template <typename Real>
+size_t orthonormalize(Real* X, size_t n, size_t m) {
+	// Modified Gram-Schmidt, applied twice, dependent columns are dropped. Returns the new rank
+	size_t r = 0;
+	for (size_t k = 0; k < m; ++k) {
+		Real* xk = X+k*n;
+		double nrm0 = 0, nrm = 0;
+		#pragma omp parallel for reduction(+:nrm0)
+		for (size_t j = 0; j < n; ++j) nrm0 += xk[j]*xk[j];
+		for (int pass = 0; pass < 2; ++pass) {
+			for (size_t q = 0; q < r; ++q) {
+				double dot = 0;
+				#pragma omp parallel for reduction(+:dot)
+				for (size_t j = 0; j < n; ++j) dot += X[q*n+j]*xk[j];
+				#pragma omp parallel for
+				for (size_t j = 0; j < n; ++j) xk[j] -= dot*X[q*n+j];
+			}
+		}
+		#pragma omp parallel for reduction(+:nrm)
+		for (size_t j = 0; j < n; ++j) nrm += xk[j]*xk[j];
+		if (nrm < 1e-20*nrm0 || nrm == 0) continue;
+		nrm = std::sqrt(nrm);
+		#pragma omp parallel for
+		for (size_t j = 0; j < n; ++j) X[r*n+j] = xk[j]/nrm;
+		++r;
+	}
+	return r;
+}
+
+inline std::vector<double> window_filter(double lo, double hi, double a, double b) {
+	// Jackson damped Chebyshev expansion of the step function on [a,b], spectrum in [lo,hi]
+	double c = (hi+lo)/2, e = (hi-lo)/2;
+	double ta = std::acos(std::max(-1.0,(a-c)/e)), tb = std::acos(std::min(1.0,(b-c)/e));
+	int deg = std::min(300,std::max(20,int(2*M_PI*(hi-lo)/(b-a))));
+	std::vector<double> mu(deg+1,0);
+	for (int k = 0; k <= deg; ++k) {
+		double g = ((deg-k+1)*std::cos(M_PI*k/(deg+1))+std::sin(M_PI*k/(deg+1))/std::tan(M_PI/(deg+1)))/(deg+1);
+		mu[k] = g * ((k == 0) ? (ta-tb)/M_PI : 2*(std::sin(k*ta)-std::sin(k*tb))/(k*M_PI));
+	}
+	return mu;
+}
+
+template <typename Real>
+double filter_count(Matrix<Real>* ham, const std::vector<double>& mu, double c, double e, 
+					size_t n, std::mt19937& gen, int nsample = 10) {
+	// Estimate the number of eigenvalues in a window with a stochastic trace of its filter
+	nsample = std::min(size_t(nsample),n);
+	double count = 0;
+	std::vector<Real> r(n), pr(n);
+	for (int s = 0; s < nsample; ++s) {
+		for (auto& x : r) x = (gen()%2) ? 1 : -1;
+		cheb_filter(ham,mu,c,e,r.data(),pr.data(),n);
+		for (size_t j = 0; j < n; ++j) count += r[j]*pr[j];
+	}
+	return count/nsample;
+}
+
+template <typename Real>
+void chfsi_slice(Matrix<Real>* ham, size_t n, double lo, double hi, double a, double b, bool last,
+				 std::vector<Real>& eigval, std::vector<Real>& eigvec) {
+	// Chebyshev filtered subspace iteration for eigenpairs in [a,b) ([a,b] for the last slice). 
+	// Ritz vectors in the slice with filter weight x.p(H).x below CHFSI_WEIGHT are mixtures of 
+	// states outside of it, the slice is done when every other one has converged
+	double c = (hi+lo)/2, e = (hi-lo)/2;
+	std::vector<double> mu = window_filter(lo,hi,a,b);
+	std::mt19937 gen(12345+size_t(1e3*std::abs(a)));
+	std::uniform_real_distribution<double> dist(-1.0,1.0);
+	double count = filter_count(ham,mu,c,e,n,gen);
+	size_t m = std::min(n,size_t(2*std::max(0.0,count))+20);
+	std::vector<Real> X(n*m), Y(n*m), HY(n*m), theta;
+	for (auto& x : X) x = dist(gen);
+	std::vector<bool> conv;
+	size_t iter = 0, k_conv = 0;
+	auto in_slice = [&](double t) {return t >= a && (t < b || (last && t == b));};
+	for (; iter < 100; ++iter) {
+		// Converged Ritz vectors are not filtered again
+		bool done = iter > 0;
+		for (size_t k = 0; k < m; ++k) {
+			if (k < conv.size() && conv[k]) {
+				std::copy(X.begin()+k*n,X.begin()+(k+1)*n,Y.begin()+k*n);
+				continue;
+			}
+			cheb_filter(ham,mu,c,e,X.data()+k*n,Y.data()+k*n,n);
+			if (k < theta.size() && in_slice(theta[k])) {
+				double w = 0;
+				#pragma omp parallel for reduction(+:w)
+				for (size_t j = 0; j < n; ++j) w += X[k*n+j]*Y[k*n+j];
+				if (w > CHFSI_WEIGHT) done = false;
+			}
+		}
+		if (done) break;
+		size_t r = orthonormalize(Y.data(),n,m);
+		// Rayleigh-Ritz in the filtered subspace
+		std::vector<Real> G(r*r,0), W(r*r,0);
+		theta = std::vector<Real>(r,0);
+		for (size_t k = 0; k < r; ++k) ham->mvmult(Y.data()+k*n,HY.data()+k*n,n);
+		#pragma omp parallel for schedule(dynamic)
+		for (size_t p = 0; p < r; ++p) for (size_t q = p; q < r; ++q) {
+			double dot = 0;
+			for (size_t j = 0; j < n; ++j) dot += Y[p*n+j]*HY[q*n+j];
+			G[q*r+p] = G[p*r+q] = dot;
+		}
+		ed_dsyevr(G.data(),W.data(),theta.data(),r);
+		std::fill(X.begin(),X.end(),0);
+		for (size_t j = n*r; j < n*m; ++j) X[j] = dist(gen);
+		size_t k_in = 0, k_conv_old = k_conv;
+		k_conv = 0;
+		conv = std::vector<bool>(r,false);
+		std::vector<Real> res(n);
+		for (size_t p = 0; p < r; ++p) {
+			Real* xp = X.data()+p*n;
+			double rn = 0;
+			#pragma omp parallel for reduction(+:rn)
+			for (size_t j = 0; j < n; ++j) {
+				res[j] = 0;
+				for (size_t q = 0; q < r; ++q) {
+					xp[j] += Y[q*n+j]*W[p*r+q];
+					res[j] += HY[q*n+j]*W[p*r+q];
+				}
+				rn += std::pow(res[j]-theta[p]*xp[j],2);
+			}
+			conv[p] = std::sqrt(rn) < CHFSI_TOL*std::max(1.0,std::abs(theta[p]));
+			if (!in_slice(theta[p])) continue;
+			++k_in;
+			if (conv[p]) ++k_conv;
+		}
+		// Guard vectors keep the subspace larger than the slice, grow it if it is nearly full
+		if (m < n && k_in + std::max(size_t(10),m/5) > m) {
+			size_t m_new = std::min(n,m+std::max(size_t(20),m/2));
+			X.resize(n*m_new);
+			for (size_t j = n*m; j < n*m_new; ++j) X[j] = dist(gen);
+			Y.resize(n*m_new);
+			HY.resize(n*m_new);
+			m = m_new;
+		}
+		if (k_conv != k_conv_old) conv = std::vector<bool>(r,false); // Wait for the count to settle
+	}
+	if (iter == 100) std::cout << "WARNING: slice [" << a << ", " << b << "] not converged" << std::endl;
+	for (size_t p = 0; p < theta.size(); ++p) {
+		if (!in_slice(theta[p]) || !conv[p]) continue;
+		eigval.push_back(theta[p]);
+		eigvec.insert(eigvec.end(),X.begin()+p*n,X.begin()+(p+1)*n);
+	}
+	return;
+}
+
+template <typename Real> 
+size_t ed_chfsi(Matrix<Real>* ham, std::vector<Real>& eigvec, std::vector<Real>& eigval, 
+				size_t n, double vl, double vu, int nslice) {
+	// Spectrum slicing, all eigenpairs in [vl,vu] with independent filtered subspace iterations.
+	// If nslice is 0, slices hold about CHFSI_SLICE eigenvalues each
+	double lo, hi;
+	spectral_bounds(ham,n,lo,hi);
+	vl = std::max(vl,lo);
+	vu = std::min(vu,hi);
+	if (vl >= vu) return 0;
+	std::mt19937 gen(12345);
+	double count = filter_count(ham,window_filter(lo,hi,vl,vu),(hi+lo)/2,(hi-lo)/2,n,gen);
+	if (count > CHFSI_DENSE*n && n < 1e5) {
+		// Window holds most of the spectrum, a dense solve is cheaper
+		std::cout << "Estimated eigenvalues in window: " << int(count) << ", using DSYEVR" << std::endl;
+		Real* _ham = ham->get_dense();
+		std::vector<Real> val(n), vec(n*n);
+		size_t m = ed_dsyevr(_ham,vec.data(),val.data(),n,'V',vl,vu);
+		delete [] _ham;
+		eigval.insert(eigval.end(),val.begin(),val.begin()+m);
+		eigvec.insert(eigvec.end(),vec.begin(),vec.begin()+n*m);
+		return m;
+	}
+	if (nslice <= 0) {
+		nslice = std::max(1,int(std::ceil(count/CHFSI_SLICE)));
+#ifdef _OPENMP
+		nslice = std::max(nslice,std::min(omp_get_max_threads(),int(count/20)+1));
+#endif
+		std::cout << "Estimated eigenvalues in window: " << int(count) << ", slices: " << nslice << std::endl;
+	}
+	std::vector<std::vector<Real>> val(nslice), vec(nslice);
+#ifdef _OPENMP
+	// Slices run concurrently, threads left over go to the kernels inside each slice
+	int nthreads = omp_get_max_threads(), levels = omp_get_max_active_levels();
+	omp_set_max_active_levels(2);
+	#pragma omp parallel for schedule(dynamic,1) num_threads(std::min(nslice,nthreads))
+	for (int s = 0; s < nslice; ++s) {
+		omp_set_num_threads(std::max(1,nthreads/nslice));
+		double a = vl + (vu-vl)*s/nslice, b = vl + (vu-vl)*(s+1)/nslice;
+		chfsi_slice(ham,n,lo,hi,a,b,s == nslice-1,val[s],vec[s]);
+	}
+	omp_set_max_active_levels(levels);
+#else
+	for (int s = 0; s < nslice; ++s) {
+		double a = vl + (vu-vl)*s/nslice, b = vl + (vu-vl)*(s+1)/nslice;
+		chfsi_slice(ham,n,lo,hi,a,b,s == nslice-1,val[s],vec[s]);
+	}
+#endif
+	for (int s = 0; s < nslice; ++s) {
+		eigval.insert(eigval.end(),val[s].begin(),val[s].end());
+		eigvec.insert(eigvec.end(),vec[s].begin(),vec[s].end());
+	}
+	return eigval.size();
+}
+
+#define TRLAN_TOL 1e-10
+#define TRLAN_MAX_RESTART 1000
+#define PLAN_FLOPS 2e9 // Sustained flop rate per core assumed by the solver planner
+template <typename Real>
+double orthogonalize(const Real* V, size_t n, size_t k, Real* w, double* h, Matrix<Real>* dist = nullptr) {
+	// w -= V h, h = V^T w over the first k basis vectors, a second pass is only done when
+	// cancellation is detected. Returns the norm of w
+	// dist: vectors are local rows of this matrix, sums are completed over ranks
+	auto norm = [&]() {
+		double nrm = 0;
+		#pragma omp parallel for reduction(+:nrm)
+		for (size_t j = 0; j < n; ++j) nrm += w[j]*w[j];
+		if (dist) dist->allreduce(&nrm,1);
+		return std::sqrt(nrm);
+	};
+	double nrm0 = norm(), nrm = 0;
+	std::fill(h,h+k,0);
+	for (int pass = 0; pass < 2; ++pass) {
+		std::vector<double> hp(k,0);
+		#pragma omp parallel
+		{
+			std::vector<double> hl(k,0);
+			#pragma omp for nowait
+			for (size_t j = 0; j < n; ++j)
+				for (size_t i = 0; i < k; ++i) hl[i] += V[i*n+j]*w[j];
+			#pragma omp critical
+			for (size_t i = 0; i < k; ++i) hp[i] += hl[i];
+		}
+		if (dist) dist->allreduce(hp.data(),k);
+		#pragma omp parallel for
+		for (size_t j = 0; j < n; ++j)
+			for (size_t i = 0; i < k; ++i) w[j] -= V[i*n+j]*hp[i];
+		for (size_t i = 0; i < k; ++i) h[i] += hp[i];
+		nrm = norm();
+		if (nrm > M_SQRT1_2*nrm0) break;
+		nrm0 = nrm;
+	}
+	return nrm;
+}
+
+template <typename T>
+dcomp dot_rows(Matrix<T>* ham, const vecc& u, const vecc& v, bool conj = false) {
+	// Bilinear u^T v (H - z is complex symmetric), or u^H v if conj. Vectors are local rows of 
+	// ham, sums are completed over ranks
+	int n = u.size();
+	dcomp d = 0;
+	if (conj) {
+		#pragma omp parallel for reduction (+:d)
+		for (int j = 0; j < n; ++j) d += std::conj(u[j])*v[j];
+	} else {
+		#pragma omp parallel for reduction (+:d)
+		for (int j = 0; j < n; ++j) d += u[j]*v[j];
+	}
+	ham->allreduce(&d,1);
+	return d;
+}
+
+template <typename T>
+double norm2_rows(Matrix<T>* ham, const vecc& v) {
+	// |v|^2 of local rows, summed over ranks
+	double n = ed::norm(v,true);
+	ham->allreduce(&n,1);
+	return n;
+}
+
+template <typename T>
+void shifted_mvmult(Matrix<T>* ham, const vecc& in, vecc& out, dcomp z, double scale = 1) {
+	// out = (H - z) in / scale
+	ham->mvmult_cmplx(in,out);
+	int n = in.size();
+	#pragma omp parallel for
+	for (int j = 0; j < n; ++j) out[j] = (out[j] - z*in[j])/scale;
+	return;
+}
+
+template <typename T>
+void report_residual(Matrix<T>* ham, const std::string& solver, const vecc& b, const vecc& x, dcomp z,
+					 double rn, int iter, double CG_tol) {
+	// Recursive residual rn of a (H - z)x = b solve next to the true one, the recursion can drift
+	vecc r(x.size());
+	shifted_mvmult(ham,x,r,z);
+	#pragma omp parallel for
+	for (int j = 0; j < int(r.size()); ++j) r[j] = b[j] - r[j];
+	std::ios::fmtflags f(std::cout.flags());
+	std::cout << solver << " finished with " << iter << " iterations" << std::endl;
+	std::cout << std::scientific << "Residual: " << rn << ", true residual: " << norm2_rows(ham,r) << std::endl;
+	std::cout.flags(f);
+	if (rn > CG_tol) std::cout << "CG not converged: " << rn << std::endl;
+	return;
+}
+
+template <typename Real>
+void ed_trlanczos(Matrix<Real>* ham, Real* _eigvec, Real* _eigval, size_t n, size_t nev,
+				  const std::vector<Real>& guess = std::vector<Real>()) {
+	// Thick-restart Lanczos for the lowest nev eigenpairs. At each restart the lowest Ritz 
+	// vectors are kept, the subspace grows when a restart brings no new converged pair
+	// For row partitioned matrices n is the number of local rows
+	size_t N = ham->get_full_dim();
+	Matrix<Real>* part = (N != n) ? ham : nullptr;
+	nev = std::min(nev,N);
+	size_t m = std::min(N,std::max(2*nev,nev+20)), m_max = std::min(N,std::max(4*nev,nev+200));
+	std::vector<Real> V(n*(m_max+1),0), T(m_max*m_max,0), w(n);
+	std::vector<double> h(m_max+1);
+	std::mt19937 gen(12345);
+	std::uniform_real_distribution<double> dist(-1.0,1.0);
+	// Start from the sum of the guess vectors, random noise keeps every direction present
+	for (size_t j = 0; j < n; ++j) V[j] = (guess.empty() ? 1 : 1e-3) * dist(gen);
+	for (size_t i = 0; i < guess.size(); ++i) V[i%n] += guess[i];
+	double nrm = 0;
+	for (size_t j = 0; j < n; ++j) nrm += V[j]*V[j];
+	if (part) part->allreduce(&nrm,1);
+	for (size_t j = 0; j < n; ++j) V[j] /= std::sqrt(nrm);
+	size_t k = 0, nconv = 0, restart = 0;
+	std::vector<Real> theta, Y;
+	double beta = 0;
+	while (true) {
+		for (size_t j = k; j < m; ++j) {
+			Real* v = V.data()+j*n;
+			ham->mvmult(v,w.data(),n);
+			beta = orthogonalize(V.data(),n,j+1,w.data(),h.data(),part);
+			for (size_t i = 0; i <= j; ++i) T[i*m_max+j] = T[j*m_max+i] = h[i];
+			if (beta < 1e-12) {
+				// Invariant subspace, continue with a new random direction
+				for (size_t i = 0; i < n; ++i) w[i] = dist(gen);
+				double bn = orthogonalize(V.data(),n,j+1,w.data(),h.data(),part);
+				for (size_t i = 0; i < n; ++i) w[i] /= bn;
+				beta = 0;
+			} else for (size_t i = 0; i < n; ++i) w[i] /= beta;
+			std::copy(w.begin(),w.end(),V.begin()+(j+1)*n);
+		}
+		// Rayleigh-Ritz on the projected matrix
+		std::vector<Real> Tm(m*m);
+		for (size_t i = 0; i < m; ++i) for (size_t j = 0; j < m; ++j) Tm[i*m+j] = T[i*m_max+j];
+		theta = std::vector<Real>(m);
+		Y = std::vector<Real>(m*m);
+		ed_dsyevr(Tm.data(),Y.data(),theta.data(),m);
+		size_t nconv_old = nconv;
+		for (nconv = 0; nconv < nev; ++nconv) {
+			if (std::abs(beta*Y[nconv*m+m-1]) > TRLAN_TOL*std::max(1.0,std::abs(theta[nconv]))) break;
+		}
+		if (nconv >= nev || m == N) break;
+		// Pairs can stall above TRLAN_TOL once the subspace is at m_max < N
+		if (restart >= TRLAN_MAX_RESTART) break;
+		// Keep the lowest Ritz vectors and the residual direction
+		k = std::min(m-1,nev+std::max(nconv,(m-nev)/2));
+		std::vector<Real> Vk(n*k,0);
+		#pragma omp parallel for
+		for (size_t j = 0; j < n; ++j)
+			for (size_t i = 0; i < k; ++i)
+				for (size_t q = 0; q < m; ++q) Vk[i*n+j] += V[q*n+j]*Y[i*m+q];
+		std::copy(V.begin()+m*n,V.begin()+(m+1)*n,w.begin());
+		std::copy(Vk.begin(),Vk.end(),V.begin());
+		std::copy(w.begin(),w.end(),V.begin()+k*n);
+		std::fill(T.begin(),T.end(),0);
+		for (size_t i = 0; i < k; ++i) {
+			T[i*m_max+i] = theta[i];
+			T[i*m_max+k] = T[k*m_max+i] = beta*Y[i*m+m-1];
+		}
+		// Grow the subspace if the restart did not converge a new pair
+		if (restart++ && nconv <= nconv_old && m < m_max) m = std::min(m_max,m+std::max(size_t(10),m/4));
+	}
+	std::cout << "Thick-restart Lanczos converged " << nconv << " of " << nev << " after " << restart
+			  << " restarts, subspace: " << m << std::endl;
+	if (nconv < nev) std::cout << "Thick-restart Lanczos not converged: " << nconv << " of " << nev << std::endl;
+	// Ritz pairs of the last Rayleigh-Ritz step
+	std::copy(theta.begin(),theta.begin()+nev,_eigval);
+	std::fill(_eigvec,_eigvec+n*nev,0);
+	#pragma omp parallel for
+	for (size_t j = 0; j < n; ++j)
+		for (size_t i = 0; i < nev; ++i)
+			for (size_t q = 0; q < m; ++q) _eigvec[i*n+j] += V[q*n+j]*Y[i*m+q];
+	return;
+}
+
+#define DAVIDSON_TOL 1e-9
+template <typename Real>
+void ed_davidson(Matrix<Real>* ham, Real* _eigvec, Real* _eigval, size_t n, size_t nev,
+				 const std::vector<Real>& guess = std::vector<Real>()) {
+	// Block Davidson for the lowest nev eigenpairs, corrections are preconditioned with the 
+	// Hamiltonian diagonal (theta - H_ii)^-1 r_i. The block holds a few guard vectors so 
+	// degenerate multiplets at the edge of nev converge together
+	nev = std::min(nev,n);
+	size_t nb = std::min(n,nev+std::max(size_t(4),nev/4)), m_max = std::min(n,std::max(4*nb,nb+40));
+	std::vector<Real> V(n*m_max), AV(n*m_max), diag(n), theta, X, res(n*nb);
+	std::vector<double> h(m_max);
+	ham->get_diag(diag.data());
+	// Start from the guess vectors, the rest of the block from unit vectors on the lowest 
+	// diagonal elements, with a small random admixture
+	size_t ng = std::min(nb,guess.size()/n);
+	std::vector<size_t> ind(n);
+	std::iota(ind.begin(),ind.end(),0);
+	std::partial_sort(ind.begin(),ind.begin()+nb,ind.end(),[&](size_t a, size_t b){return diag[a] < diag[b];});
+	std::mt19937 gen(12345);
+	std::uniform_real_distribution<double> dist(-1.0,1.0);
+	std::copy(guess.begin(),guess.begin()+n*ng,V.begin());
+	for (size_t i = n*ng; i < n*nb; ++i) V[i] = 1e-2*dist(gen);
+	for (size_t i = ng; i < nb; ++i) V[i*n+ind[i-ng]] += 1;
+	size_t k = orthonormalize(V.data(),n,nb), k_new = k, iter = 0, nconv = 0;
+	lpk_int N = n;
+	Real one = 1, zero = 0;
+	char TR = 'T', NT = 'N';
+	for (; iter < 1000; ++iter) {
+		ham->mmult(V.data()+(k-k_new)*n,AV.data()+(k-k_new)*n,n,k_new);
+		// Rayleigh-Ritz in the search space
+		lpk_int K = k;
+		std::vector<Real> G(k*k);
+		_gemm(&TR,&NT,&K,&K,&N,&one,V.data(),&N,AV.data(),&N,&zero,G.data(),&K);
+		theta = std::vector<Real>(k);
+		std::vector<Real> Y(k*k);
+		ed_dsyevr(G.data(),Y.data(),theta.data(),k);
+		size_t nx = std::min(nb,k);
+		lpk_int NX = nx;
+		std::vector<Real> AX(n*nx);
+		X = std::vector<Real>(n*nx);
+		_gemm(&NT,&NT,&N,&NX,&K,&one,V.data(),&N,Y.data(),&K,&zero,X.data(),&N);
+		_gemm(&NT,&NT,&N,&NX,&K,&one,AV.data(),&N,Y.data(),&K,&zero,AX.data(),&N);
+		// Residuals and preconditioned corrections for unconverged Ritz pairs
+		std::vector<Real> C;
+		nconv = 0;
+		bool lowest = true;
+		for (size_t i = 0; i < nx; ++i) {
+			double rn = 0;
+			#pragma omp parallel for reduction(+:rn)
+			for (size_t j = 0; j < n; ++j) {
+				res[j] = AX[i*n+j] - theta[i]*X[i*n+j];
+				rn += res[j]*res[j];
+			}
+			if (std::sqrt(rn) < DAVIDSON_TOL*std::max(1.0,std::abs(theta[i]))) {
+				if (lowest && i < nev) ++nconv;
+				continue;
+			}
+			lowest = false;
+			size_t c = C.size();
+			C.resize(c+n);
+			#pragma omp parallel for
+			for (size_t j = 0; j < n; ++j) {
+				double d = theta[i] - diag[j];
+				if (std::abs(d) < 1e-8) d = (d < 0) ? -1e-8 : 1e-8;
+				C[c+j] = res[j]/d;
+			}
+		}
+		if (nconv >= nev || k >= n) break;
+		if (k + C.size()/n > m_max) {
+			// Restart with the lowest Ritz vectors, twice the block size
+			size_t nk = std::min(k,2*nb);
+			lpk_int NK = nk;
+			std::vector<Real> Vk(n*nk), AVk(n*nk);
+			_gemm(&NT,&NT,&N,&NK,&K,&one,V.data(),&N,Y.data(),&K,&zero,Vk.data(),&N);
+			_gemm(&NT,&NT,&N,&NK,&K,&one,AV.data(),&N,Y.data(),&K,&zero,AVk.data(),&N);
+			std::copy(Vk.begin(),Vk.end(),V.begin());
+			std::copy(AVk.begin(),AVk.end(),AV.begin());
+			k = nk;
+		}
+		k_new = C.size()/n;
+		for (size_t c = 0; c < k_new; ++c) orthogonalize(V.data(),n,k,C.data()+c*n,h.data());
+		k_new = orthonormalize(C.data(),n,k_new);
+		// A second pass, the corrections were orthogonalized against V before each other
+		for (size_t c = 0; c < k_new; ++c) orthogonalize(V.data(),n,k,C.data()+c*n,h.data());
+		k_new = orthonormalize(C.data(),n,k_new);
+		if (k_new == 0) break;
+		std::copy(C.begin(),C.begin()+k_new*n,V.begin()+k*n);
+		k += k_new;
+	}
+	std::cout << "Block Davidson converged " << nconv << " of " << nev << " after " << iter
+			  << " iterations" << std::endl;
+	if (nconv < nev) std::cout << "Block Davidson not converged: " << nconv << " of " << nev << std::endl;
+	// Ritz pairs of the last Rayleigh-Ritz step, the search space may have changed since
+	size_t nx = std::min(nev,X.size()/n);
+	std::copy(theta.begin(),theta.begin()+nx,_eigval);
+	std::copy(X.begin(),X.begin()+n*nx,_eigvec);
+	return;
+}
+
 template <typename T>
 int Lanczos(Matrix<T>* ham, const vecc& v0, vecc& alpha, vecc& betha, int niter_CFE=150) {
 	// Lanczos iteration, obtains tridiagonal matrix alpha_i, beta_i. 
-	// returns new niter_CFE value
+	// returns new niter_CFE value, 0 if v0 vanishes
+	// Row partitioned matrices work on the local part of v0, sums are completed over ranks
 	int hsize = ham->get_mat_dim();
 	// std::cout << "Hdim: " << hsize  << "," << v0.size() << std::endl;
 	vecc phip(hsize,0);
 	vecc phipp(hsize,0);
 	vecc phil(hsize,0);
 	// Normalize the vector
-	vecc phi = v0;
-	ed::norm_vec(phi);
+	vecc phi = ham->scatter(v0);
+	double nrm = ed::norm(phi,true);
+	ham->allreduce(&nrm,1);
+	if (nrm == 0) return 0; // No weight, the tridiagonal is empty
+	nrm = std::sqrt(nrm);
+	#pragma omp parallel for
+	for (int j = 0; j < hsize; ++j) phi[j] = phi[j] / nrm;
 
 	for (int i = 0; i < niter_CFE; ++i) {
 		ham->mvmult_cmplx(phi,phip);
 		dcomp alpha_element(0);
 		#pragma omp parallel for reduction (+:alpha_element)
 		for (int j = 0; j < hsize; ++j) alpha_element += std::conj(phi[j])*phip[j];
+		ham->allreduce(&alpha_element,1);
 		alpha[i] = alpha_element;
 		if (i != 0) {
 			#pragma omp parallel for 
@@ -121,7 +683,9 @@ int Lanczos(Matrix<T>* ham, const vecc& v0, vecc& alpha, vecc& betha, int niter_
 		#pragma omp parallel for 
 		for (int j = 0; j < hsize; ++j) phipp[j] = phip[j] - alpha[i] * phi[j];
 		if (i != niter_CFE-1) {
-			betha[i+1] = ed::norm(phipp);
+			double b2 = ed::norm(phipp,true);
+			ham->allreduce(&b2,1);
+			betha[i+1] = std::sqrt(b2);
 			if (std::abs(betha[i+1]) < 1E-13) {
 				std::cout << "Lanzcos ended after: " << i << " steps." << std::endl;
 				niter_CFE = i;
@@ -135,31 +699,151 @@ int Lanczos(Matrix<T>* ham, const vecc& v0, vecc& alpha, vecc& betha, int niter_
 	return niter_CFE;
 };
 
+struct CFECoef {
+	// Lanczos tridiagonal of one start vector, the continued fraction can be redone on any grid
+	int gsblk = 0, exblk = 0; // RIXS loss steps: final state block, exblk = -1 (all EX blocks)
+	double inc_en = 0; // Incident energy of a RIXS loss step
+	double E0 = 0, factor = 0;
+	vecd alpha, betha;
+};
+
+inline void cfe_spectrum(const CFECoef& cf, const vecd& specX, vecd& specY, double eps) {
+	int nedos = specX.size(), niter_CFE = cf.alpha.size();
+	const vecd &alpha = cf.alpha, &betha = cf.betha;
+	if (!niter_CFE) return;
+	#pragma omp parallel for
+	for (int i = 0; i < nedos; ++i) {
+		dcomp z = dcomp(specX[i]+cf.E0,eps), intensity = z - alpha[niter_CFE-1];
+		for (int j = 1; j < niter_CFE; ++j) {
+			intensity = z - alpha[niter_CFE-j-1] - (pow(betha[niter_CFE-j],2)/intensity);
+		}
+		specY[i] += -1/PI * std::imag(cf.factor/intensity);
+	}
+	return;
+}
+
 template <typename T>
 void ContFracExpan(Matrix<T>* ham, const vecc& v0, double E0, vecd& specX, vecd& specY, 
-					double eps = 0.1, int niter_CFE=150) {
+					double eps = 0.1, int niter_CFE=150, CFECoef* coef = nullptr) {
 	// This solver specifically does not subtract elastic scattering
 	// specX should specify: minE, maxE, nedos
-	int nedos = specX.size();
-	vecc intensity(nedos,0);
+	// The coefficients are returned in coef if it is set
+	CFECoef cf;
 	double factor = ed::norm(v0);
-	factor = factor*factor;
+	cf.E0 = E0;
+	cf.factor = factor*factor;
 	// std::cout << "FACTOR: " << factor << std::endl;
 	vecc alpha(niter_CFE,0);
 	vecc betha(niter_CFE,0);
 	niter_CFE = Lanczos(ham,v0,alpha,betha,niter_CFE);
 	// for (int i = 0; i < niter_CFE; ++i) std::cout << "a: " << alpha[i] << ", b: " << betha[i] << std::endl;
-	#pragma omp parallel for shared(intensity,specY,alpha,betha)
+	// H is Hermitian, the tridiagonal is real
+	cf.alpha.resize(niter_CFE);
+	cf.betha.resize(niter_CFE);
+	for (int i = 0; i < niter_CFE; ++i) {
+		cf.alpha[i] = std::real(alpha[i]);
+		cf.betha[i] = std::real(betha[i]);
+	}
+	cfe_spectrum(cf,specX,specY,eps);
+	if (coef) {
+		cf.gsblk = coef->gsblk;
+		cf.exblk = coef->exblk;
+		cf.inc_en = coef->inc_en;
+		*coef = std::move(cf);
+	}
+	return;
+}
+
+struct KPMMoments {
+	// Chebyshev moments mu_n = <v|T_n((H-b)/a)|v> of one start vector, any grid and broadening
+	// can be evaluated from them
+	double a = 1, b = 0, E0 = 0;
+	vecd mu;
+};
+
+inline void kpm_spectrum(const KPMMoments& km, const vecd& specX, vecd& specY, double eps, int kernel = 0) {
+	// Kernel 0 (Jackson): peaks become Gaussians of width ~pi*a/N, the moments are cut at N = pi*a/eps.
+	// Kernel 1 (Lorentz): peaks become Lorentzians of width lambda*a/N, lambda = N*eps/a matches the 
+	// continued fraction
+	int nmom = km.mu.size(), nedos = specX.size();
+	if (kernel == 0) nmom = std::max(2,std::min(nmom,int(std::ceil(PI*km.a/eps))));
+	vecd g(nmom,1);
+	double lambda = nmom*eps/km.a;
+	for (int n = 0; n < nmom; ++n) {
+		if (kernel == 1) g[n] = std::sinh(lambda*(1-double(n)/nmom))/std::sinh(lambda);
+		else g[n] = ((nmom-n+1)*std::cos(PI*n/(nmom+1)) + std::sin(PI*n/(nmom+1))/std::tan(PI/(nmom+1)))/(nmom+1);
+	}
+	#pragma omp parallel for
 	for (int i = 0; i < nedos; ++i) {
-		dcomp z = dcomp(specX[i]+E0,eps);
-		intensity[i] = z - alpha[niter_CFE-1];
-		for (int j = 1; j < niter_CFE; ++j) {
-			intensity[i] = z - alpha[niter_CFE-j-1] - 
-							(pow(betha[niter_CFE-j],2)/intensity[i]);
+		double x = (specX[i]+km.E0-km.b)/km.a;
+		if (x <= -1 || x >= 1) continue;
+		// T_n(x) by recurrence
+		double t0 = 1, t1 = x, s = g[0]*km.mu[0];
+		for (int n = 1; n < nmom; ++n) {
+			s += 2*g[n]*km.mu[n]*t1;
+			double t2 = 2*x*t1 - t0;
+			t0 = t1;
+			t1 = t2;
 		}
-		specY[i] += -1/PI * std::imag(factor/intensity[i]);
+		specY[i] += s/(PI*km.a*std::sqrt(1-x*x));
 	}
+	return;
+}
 
+template <typename T>
+void KPMExpan(Matrix<T>* ham, const vecc& v0, double E0, vecd& specX, vecd& specY, 
+				double eps = 0.1, int nmom = 1000, int kernel = 0, KPMMoments* moments = nullptr) {
+	// Kernel polynomial alternative to ContFracExpan, same spectrum -1/pi Im <v|1/(E+E0-H+i eps)|v>
+	// A short Lanczos run bounds the spectrum of H, then mu_2n and mu_2n+1 follow from
+	// a_n = T_n(H~)v with one matvec: mu_2n = 2<a_n|a_n> - mu_0, mu_2n+1 = 2<a_n+1|a_n> - mu_1.
+	// Row partitioned matrices work on the local part of v0, sums are completed over ranks
+	int hsize = ham->get_mat_dim();
+	KPMMoments km;
+	km.E0 = E0;
+	if (ed::norm(v0) == 0) return;
+	int nlan = 60;
+	vecc alpha(nlan,0), betha(nlan,0);
+	// Bounds of the whole spectrum, the recursion blows up on any component of v0 outside of them.
+	// Lanczos stops at step i once betha[i+1] vanishes, alpha[0..i] are all valid then
+	vecc vs(v0.size());
+	for (size_t i = 0; i < vs.size(); ++i) vs[i] = ((i%7)+1)/4.0;
+	int nret = Lanczos(ham,vs,alpha,betha,nlan);
+	nlan = nret < nlan ? nret+1 : nlan;
+	vecd tri(nlan*nlan,0), tvec(nlan*nlan,0), tval(nlan,0);
+	for (int i = 0; i < nlan; ++i) {
+		tri[i*nlan+i] = std::real(alpha[i]);
+		if (i) tri[i*nlan+i-1] = tri[(i-1)*nlan+i] = std::real(betha[i]);
+	}
+	ed_dsyevr(tri.data(),tvec.data(),tval.data(),nlan);
+	double margin = (nlan < int(betha.size()) ? std::abs(betha[nlan]) : 0) + 1e-3;
+	double lo = tval[0] - margin, hi = tval[nlan-1] + margin;
+	// Kernels broaden uniformly in arccos(x), peaks close to +-1 come out too narrow and their
+	// tails are cut. Widen the window by a few eps so that the spectrum stays in the middle
+	lo -= 5*eps;
+	hi += 5*eps;
+	km.a = (hi-lo)/2;
+	km.b = (hi+lo)/2;
+	km.mu = vecd(nmom,0);
+	// H~ v = (H v - b v)/a, moments are real for Hermitian H
+	auto apply = [&](const vecc& in, vecc& out) {shifted_mvmult(ham,in,out,km.b,km.a);};
+	auto dot = [&](const vecc& u, const vecc& v) {return std::real(dot_rows(ham,u,v,true));};
+	vecc an = ham->scatter(v0), anp(hsize,0), anl(hsize,0);
+	apply(an,anp);
+	km.mu[0] = dot(an,an);
+	if (nmom > 1) km.mu[1] = dot(an,anp);
+	for (int n = 1; 2*n < nmom; ++n) {
+		anl.swap(an);
+		an.swap(anp);
+		// a_n+1 = 2H~a_n - a_n-1
+		apply(an,anp);
+		#pragma omp parallel for
+		for (int j = 0; j < hsize; ++j) anp[j] = 2.0*anp[j] - anl[j];
+		km.mu[2*n] = 2*dot(an,an) - km.mu[0];
+		if (2*n+1 < nmom) km.mu[2*n+1] = 2*dot(anp,an) - km.mu[1];
+	}
+	std::cout << "KPM moments: " << nmom << ", spectral bounds: " << lo << ", " << hi << std::endl;
+	kpm_spectrum(km,specX,specY,eps,kernel);
+	if (moments) *moments = std::move(km);
 	return;
 }
 
@@ -169,15 +853,24 @@ vecc BiCGS(Matrix<T>* ham, const vecc& b, const dcomp z, double CG_tol = 1e-8,
 	// Solve (A-zI)x = b, where z is a complex number.
 	// Modified from Eigen, with diagonal preconditioner 1/(ham-z)
 	// See https://github.com/cryos/eigen/blob/master/Eigen/src/IterativeLinearSolvers/BiCGSTAB.h
+	// b and x0 are full vectors, row partitioned matrices solve for the local part and the 
+	// full solution is gathered
+	if (ed::norm(b) == 0) return vecc(b.size(),0);
 	int hsize = ham->get_mat_dim();
-	vecc r(hsize,0), r0(hsize,0), x(hsize,0);
+	vecc r(hsize,0), r0(hsize,0), x(hsize,0), bl = ham->scatter(b);
+	auto norm2 = [&](const vecc& vec) {
+		double n = ed::norm(vec,true);
+		ham->allreduce(&n,1);
+		return n;
+	};
 	if (x0.size() != 0) {
 		std::cout << "There is initial guess" << std::endl;
-		ham->mvmult_cmplx(x0,r);  
+		vecc xl = ham->scatter(x0);
+		ham->mvmult_cmplx(xl,r);  
         #pragma omp parallel for
         for (int j = 0; j < hsize; ++j)
-        	r[j] = b[j] - r[j] + x0[j]*z; // r = b - A*x_0 
-	} else r = b;
+        	r[j] = bl[j] - r[j] + xl[j]*z; // r = b - A*x_0 
+	} else r = bl;
 	r0 = r;
 	// Do a conjugate first to save a bit of speed
 	#pragma omp parallel for
@@ -186,20 +879,21 @@ vecc BiCGS(Matrix<T>* ham, const vecc& b, const dcomp z, double CG_tol = 1e-8,
 	dcomp rho = 1.0, alpha = 1.0, rho_old = 1.0;
     vecc v(hsize,0), t(hsize,0), h(hsize,0);
     vecc s(hsize,0), p(hsize,0), shat(hsize,0), phat(hsize,0);
-    double r0sqnorm = ed::norm(r0,true);
+    double r0sqnorm = norm2(r0);
     int i = 0;
-    while (ed::norm(r,true) > CG_tol and i < max_iter) {
+    while (norm2(r) > CG_tol and i < max_iter) {
     	// STEP 1: rho = (r0,r)
     	omega = w_old; // This is necessary, but I don't know why
     	if (i%50 == 0) {
 	    	std::cout << std::setprecision(15);
-	        std::cout << "iter: " << i << ", redisual: " << ed::norm(r,true);
-	        if (i!=0) std::cout << ", s:" << ed::norm(s,true);
+	        std::cout << "iter: " << i << ", redisual: " << norm2(r);
+	        if (i!=0) std::cout << ", s:" << norm2(s);
 	        std::cout << std::endl;
 	    }
     	rho  = 0;
     	#pragma omp parallel for reduction (+:rho)
 		for (int j = 0; j < hsize; ++j) rho += r0[j]*r[j];
+		ham->allreduce(&rho,1);
 		// if (std::real(rho) < 1e-12) {
 		// 	std::cout << "New search direction cannot be found in BiCGStab" << std::endl;
 		// 	break;
@@ -227,6 +921,7 @@ vecc BiCGS(Matrix<T>* ham, const vecc& b, const dcomp z, double CG_tol = 1e-8,
         dcomp rv = 0;
         #pragma omp parallel for reduction (+:rv)
 		for (int j = 0; j < hsize; ++j) rv += r0[j]*v[j];
+		ham->allreduce(&rv,1);
         alpha = rho/rv;
 		// std::cout << "alpha: " << alpha << std::endl;
     	// STEP 6: h = x + alpha*p
@@ -238,7 +933,7 @@ vecc BiCGS(Matrix<T>* ham, const vecc& b, const dcomp z, double CG_tol = 1e-8,
 		for (int j = 0; j < hsize; ++j)
             r[j] -= alpha * v[j];
         s = r;
-        if (ed::norm(s,true) <= CG_tol) {
+        if (norm2(s) <= CG_tol) {
         	// Testing
         	#pragma omp parallel for
 	        for (int j = 0; j < hsize; ++j)
@@ -256,7 +951,8 @@ vecc BiCGS(Matrix<T>* ham, const vecc& b, const dcomp z, double CG_tol = 1e-8,
         dcomp omega = 0;
         #pragma omp parallel for reduction (+:omega)
 		for (int j = 0; j < hsize; ++j) omega += std::conj(t[j])*s[j];
-		omega /= ed::norm(t,true);
+		ham->allreduce(&omega,1);
+		omega /= norm2(t);
 		// std::cout << "omega: " << omega << std::endl;
 		// STEP 10: x = h + w*s
 		#pragma omp parallel for
@@ -272,9 +968,169 @@ vecc BiCGS(Matrix<T>* ham, const vecc& b, const dcomp z, double CG_tol = 1e-8,
         ++i;
     }
     std::cout << "CG finished with " << i << " iterations" << std::endl;
-    std::cout << "Ridisual: " << ed::norm(r,true) << std::endl;
-    if (i >= max_iter) std::cout << "CG not converged: " << ed::norm(r,true) << std::endl;
-    return x;
+    std::cout << "Ridisual: " << norm2(r) << std::endl;
+    if (i >= max_iter) std::cout << "CG not converged: " << norm2(r) << std::endl;
+    return ham->gather(x);
+}
+
+template <typename T>
+vecc COCG(Matrix<T>* ham, const vecc& b, const dcomp z, double CG_tol = 1e-8,
+				const vecc& x0 = vecc(), int max_iter = 2e4) {
+	// Solve (A-zI)x = b with conjugate orthogonal CG (van der Vorst & Melissen 1990).
+	// A-zI is complex symmetric, the bilinear form (u,v) = u^T v replaces the inner product
+	// and CG keeps its short recurrences with one matvec per iteration.
+	// b and x0 are full vectors, row partitioned matrices solve for the local part and gather
+	if (ed::norm(b) == 0) return vecc(b.size(),0);
+	int hsize = ham->get_mat_dim();
+	vecc bl = ham->scatter(b), r = bl, x(hsize,0), p(hsize,0), q(hsize,0);
+	if (x0.size() != 0) {
+		std::cout << "There is initial guess" << std::endl;
+		x = ham->scatter(x0);
+		shifted_mvmult(ham,x,q,z);
+		#pragma omp parallel for
+		for (int j = 0; j < hsize; ++j) r[j] -= q[j];
+	}
+	p = r;
+	dcomp rho = dot_rows(ham,r,r);
+	double rn = norm2_rows(ham,r);
+	int i = 0;
+	for (; i < max_iter && rn > CG_tol; ++i) {
+		if (i%50 == 0) std::cout << "iter: " << i << ", residual: " << rn << std::endl;
+		shifted_mvmult(ham,p,q,z);
+		dcomp pq = dot_rows(ham,p,q);
+		if (std::abs(pq) == 0) {
+			std::cout << "COCG breakdown, (p,Ap) = 0" << std::endl;
+			break;
+		}
+		dcomp alpha = rho/pq;
+		#pragma omp parallel for
+		for (int j = 0; j < hsize; ++j) {
+			x[j] += alpha*p[j];
+			r[j] -= alpha*q[j];
+		}
+		dcomp rho_new = dot_rows(ham,r,r);
+		dcomp beta = rho_new/rho;
+		rho = rho_new;
+		#pragma omp parallel for
+		for (int j = 0; j < hsize; ++j) p[j] = r[j] + beta*p[j];
+		rn = norm2_rows(ham,r);
+	}
+	report_residual(ham,"COCG",bl,x,z,rn,i,CG_tol);
+	return ham->gather(x);
+}
+
+template <typename T>
+vecc COCR(Matrix<T>* ham, const vecc& b, const dcomp z, double CG_tol = 1e-8,
+				const vecc& x0 = vecc(), int max_iter = 2e4) {
+	// Solve (A-zI)x = b with conjugate orthogonal conjugate residual (Sogabe & Zhang 2007).
+	// Same cost as COCG, one matvec per iteration, A r is carried along so that Ap follows 
+	// from the recurrence. The residual decreases more smoothly than in COCG.
+	// b and x0 are full vectors, row partitioned matrices solve for the local part and gather
+	if (ed::norm(b) == 0) return vecc(b.size(),0);
+	int hsize = ham->get_mat_dim();
+	vecc bl = ham->scatter(b), r = bl, x(hsize,0), p(hsize,0), q(hsize,0), ar(hsize,0);
+	if (x0.size() != 0) {
+		std::cout << "There is initial guess" << std::endl;
+		x = ham->scatter(x0);
+		shifted_mvmult(ham,x,q,z);
+		#pragma omp parallel for
+		for (int j = 0; j < hsize; ++j) r[j] -= q[j];
+	}
+	// p = r, q = Ap = Ar
+	p = r;
+	shifted_mvmult(ham,r,ar,z);
+	q = ar;
+	dcomp rho = dot_rows(ham,r,ar);
+	double rn = norm2_rows(ham,r);
+	int i = 0;
+	for (; i < max_iter && rn > CG_tol; ++i) {
+		if (i%50 == 0) std::cout << "iter: " << i << ", residual: " << rn << std::endl;
+		dcomp qq = dot_rows(ham,q,q);
+		if (std::abs(qq) == 0) {
+			std::cout << "COCR breakdown, (Ap,Ap) = 0" << std::endl;
+			break;
+		}
+		dcomp alpha = rho/qq;
+		#pragma omp parallel for
+		for (int j = 0; j < hsize; ++j) {
+			x[j] += alpha*p[j];
+			r[j] -= alpha*q[j];
+		}
+		shifted_mvmult(ham,r,ar,z);
+		dcomp rho_new = dot_rows(ham,r,ar);
+		dcomp beta = rho_new/rho;
+		rho = rho_new;
+		#pragma omp parallel for
+		for (int j = 0; j < hsize; ++j) {
+			p[j] = r[j] + beta*p[j];
+			q[j] = ar[j] + beta*q[j];
+		}
+		rn = norm2_rows(ham,r);
+	}
+	report_residual(ham,"COCR",bl,x,z,rn,i,CG_tol);
+	return ham->gather(x);
+}
+
+template <typename T>
+std::vector<vecc> shifted_COCG(Matrix<T>* ham, const vecc& b, const vecc& z, double CG_tol = 1e-8,
+								int max_iter = 2e4) {
+	// Solve (A-z_k I)x_k = b for all shifts z_k in one Krylov sequence. A-zI is complex symmetric,
+	// COCG on the seed shift z_0 gives residuals collinear to every shifted system, r_k = r/pi_k
+	// (Takayama et al. 2006). Shifts stop updating once |r_k|^2 < CG_tol
+	// b is a full vector, row partitioned matrices solve for the local part and gather
+	if (ed::norm(b) == 0) return std::vector<vecc>(z.size(),vecc(b.size(),0));
+	int hsize = ham->get_mat_dim(), nz = z.size();
+	vecc r = ham->scatter(b), q(hsize,0), p(hsize,0);
+	std::vector<vecc> x(nz,vecc(hsize,0)), ps(nz,vecc(hsize,0));
+	vecc pi(nz,1.0), pi_old(nz,1.0), beta_k(nz,0.0);
+	std::vector<bool> conv(nz,false);
+	dcomp alpha_old = 1.0, beta = 0.0, rho_old = 1.0;
+	int i = 0, nconv = 0;
+	for (; i < max_iter && nconv < nz; ++i) {
+		dcomp rho = dot_rows(ham,r,r);
+		double rn = norm2_rows(ham,r);
+		if (i > 0) beta = rho/rho_old;
+		// Shifted systems first, they use r before it is updated
+		for (int k = 0; k < nz; ++k) {
+			if (conv[k]) continue;
+			if (rn/std::norm(pi[k]) < CG_tol) {
+				conv[k] = true;
+				nconv++;
+				continue;
+			}
+			if (i > 0) beta_k[k] = std::pow(pi_old[k]/pi[k],2) * beta;
+			#pragma omp parallel for
+			for (int j = 0; j < hsize; ++j) ps[k][j] = r[j]/pi[k] + beta_k[k]*ps[k][j];
+		}
+		if (i%50 == 0) std::cout << "iter: " << i << ", seed residual: " << rn << ", converged shifts: " 
+								 << nconv << "/" << nz << std::endl;
+		if (nconv == nz) break;
+		#pragma omp parallel for
+		for (int j = 0; j < hsize; ++j) p[j] = r[j] + beta*p[j];
+		shifted_mvmult(ham,p,q,z[0]);
+		dcomp alpha = rho/dot_rows(ham,p,q);
+		for (int k = 0; k < nz; ++k) {
+			if (conv[k]) continue;
+			dcomp sigma = z[0]-z[k];
+			dcomp pi_new = (1.0+alpha*sigma)*pi[k] + (alpha*beta/alpha_old)*(pi[k]-pi_old[k]);
+			dcomp alpha_k = pi[k]/pi_new*alpha;
+			pi_old[k] = pi[k];
+			pi[k] = pi_new;
+			#pragma omp parallel for
+			for (int j = 0; j < hsize; ++j) x[k][j] += alpha_k*ps[k][j];
+		}
+		#pragma omp parallel for
+		for (int j = 0; j < hsize; ++j) r[j] -= alpha*q[j];
+		alpha_old = alpha;
+		rho_old = rho;
+	}
+	std::cout << "Shifted COCG finished with " << i << " iterations, converged shifts: " 
+			  << nconv << "/" << nz << std::endl;
+	for (int k = 0; k < nz; ++k) {
+		if (!conv[k]) std::cout << "Shift " << z[k] << " not converged: " << norm2_rows(ham,r)/std::norm(pi[k]) << std::endl;
+		x[k] = ham->gather(x[k]);
+	}
+	return x;
 }
 
 template <typename T>
@@ -286,10 +1142,22 @@ public:
 	size_t size, f_ind; // Accumulated first index of this Block
 	size_t nev;			// Number of eigenvalues
 	int diag_option;
+	char range = 'A';	// DSYEVR range, 'A': all, 'I': lowest nev_in, 'V': eigenvalues in (vl,vu]
+	double vl = 0, vu = 0;
+	int nslice = 0;		// Spectrum slices for option 5, 0: automatic
+	bool warm_start = false; // Iterative solvers start from the eigenvectors of the last solve
+	std::vector<double> guess; // Starting vectors for iterative solvers, size*k
+	int owner = 0;		// MPI rank that assembles and diagonalizes this block
+	bool mpi_rows = false; // Rows are spread over all MPI ranks, only thick-restart Lanczos runs
 
-	Matrix<T>* ham;
+	Matrix<T>* ham = nullptr;
 	uptrd eig, eigvec;
+	std::vector<size_t> zptr; // Compressed eigenvectors, vector n is zval/zvalf[zptr[n]:zptr[n+1]]
+	std::vector<uint32_t> zind; // Row of each kept coefficient, empty when every row is kept
+	std::vector<double> zval;
+	std::vector<float> zvalf;
 	std::vector<int> einrange;
+	std::vector<int> eigsym; // Symmetry class of each eigenvector, set when symmetry blocks are unfolded
 	std::vector<ulli> rank; // rank keeps some rank information for faster hashing
 	Block(double Sz, double Jz, double K, size_t size, size_t f_ind_in = 0,
 		std::vector<ulli> rank_in = std::vector<ulli>(0)):
@@ -309,34 +1177,101 @@ public:
 		_eig = std::move(blk._eig);
 		_eigvec = std::move(blk._eigvec);
 		rank = std::move(blk.rank);
+		eigsym = std::move(blk.eigsym);
+		zptr = std::move(blk.zptr);
+		zind = std::move(blk.zind);
+		zval = std::move(blk.zval);
+		zvalf = std::move(blk.zvalf);
 	};
 
 	~Block() {}
 	double get_sz() {return Sz;};
 	double get_jz() {return Jz;};
 	double get_k() {return K;};	
-	void malloc_ham(int diag_option) {
-		// If matrix is too large, automatically use arpack
-		if (size >= 1e5) {
-			this->diag_option = 4;
-			ham = new EZSparse<double>();
-		} else if (size <= 2e3) {
-			this->diag_option = 2;
-			ham = new Dense<double>();
-		} else {
-			if (diag_option > 4 && diag_option < 1) diag_option = 4;
-			this->diag_option = diag_option;
-			if (diag_option == 4) ham = new EZSparse<double>();
-			else ham = new Dense<double>();
+	void plan_cost(int option, size_t nev_req, double nnz_row, double& mem, double& time) {
+		// Estimated memory (bytes) and run time (s) of a solver, iterative solvers store EZSparse
+		double n = size, nnz = n*std::min(n,std::max(1.0,nnz_row)), k = std::min(double(nev_req),n);
+		double cores = 1, sparse = 24*std::max(100*n,(nnz+n)/2);
+#ifdef _OPENMP
+		cores = omp_get_max_threads();
+#endif
+#ifndef __ARPACK_HPP__
+		if (option == 4) option = 2; // Falls back to DSYEVR
+#endif
+		if (option == 1 || option == 2 || option == 3) {
+			mem = 16*n*n;
+			time = ((option == 1) ? 25 : (option == 2) ? 4 : 9)*n*n*n/(PLAN_FLOPS*cores);
+			return;
+		}
+		double m = (option == 4) ? 2*std::min(k,n/3)+1 : std::min(n,std::max(2*k,k+20));
+		double m_max = (option == 4) ? m : std::min(n,std::max(4*k,k+200)), matvec = 10*m;
+		if (option == 7) {
+			m = std::min(n,k+std::max(4.0,k/4));
+			m_max = 2*std::min(n,std::max(4*m,m+40));
+			matvec = 100*m;
+		}
+		mem = sparse + 8*n*(m_max+1) + 8*n*k;
+		// Orthogonalization is serial inside ARPACK
+		time = matvec*4*nnz/(PLAN_FLOPS*cores) + matvec*4*n*m/(PLAN_FLOPS*((option == 4) ? 1 : cores));
+		if (option == 5) time *= 10;
+		return;
+	};
+	void malloc_ham(int diag_option, size_t nev_req = 20, double nnz_row = 0, bool full = false) {
+		// Storage and solver planner. A requested option is kept if it fits in memory, iterative 
+		// solvers also need a block larger than 3 nev, a dense solve is cheaper otherwise. 
+		// Option 0 takes the cheapest estimate of DSYEVR and thick-restart Lanczos, 
+		// full: the whole spectrum is used, only go iterative if a dense solve does not fit
+		// Row partitioned blocks always use thick-restart Lanczos
+		double mem_avail = 0.8*ed::phys_mem(), mem, time;
+		auto feasible = [&](int opt) {
+			plan_cost(opt,nev_req,nnz_row,mem,time);
+			if (mem > mem_avail) return false;
+			if (opt >= 1 && opt <= 3) return size < 46341; // LAPACK integer indexing
+			return opt >= 4 && opt <= 7 && (opt == 5 || size > 3*nev_req);
+		};
+		int option = mpi_rows ? 6 : diag_option;
+#ifndef __ARPACK_HPP__
+		if (option == 4) {
+			// No ARPACK: DSYEVR if it fits, thick-restart Lanczos otherwise. Option 5 without a
+			// window is remapped in diagonalize, the range is not known yet
+			option = feasible(2) ? 2 : 6;
+			std::cout << "ARPACK not available, diagonalize option 4 -> " << option << std::endl;
 		}
+#endif
+		if (!mpi_rows && !feasible(option)) {
+			option = 0;
+			double best = -1;
+			for (int opt : {2,6}) {
+				if (!feasible(opt) || (full && option)) continue;
+				if (best < 0 || time < best) {
+					best = time;
+					option = opt;
+				}
+			}
+			if (!option) option = 6; // Nothing fits, the sparse solver needs the least memory
+			if (diag_option) std::cout << "WARNING: diagonalize option " << diag_option << " not feasible for block size "
+									   << size << ", using " << option << std::endl;
+		}
+		plan_cost(option,nev_req,nnz_row,mem,time);
+		std::cout << "Block size: " << size << ", diagonalize option: " << option << ", estimated memory: " 
+				  << mem/1e9 << " GB, time: " << time << " s" << std::endl;
+		this->diag_option = option;
+		if (mpi_rows) ham = new DistSparse<double>();
+		else if (option >= 4) ham = new EZSparse<double>();
+		else ham = new Dense<double>();
 		ham->malloc(size);
 	};
 	void diagonalize(size_t nev_in = 20, bool clear_mat = true) {
 		// Options: 1. DGEES 2. DSYEVR (MRRR) 3. DSYEV (Shifted QR) 
-		// 4. ARPACK (Lanczos)
+		// 4. ARPACK (Lanczos) 5. Spectrum slicing in [vl,vu], ARPACK if no window is set
+		// 6. Thick-restart Lanczos 7. Block Davidson
 		int option = this->diag_option;
+#ifndef __ARPACK_HPP__
+		if (option == 5 && range != 'V') option = 6; // No ARPACK, the matrix is stored sparse
+#endif
+		if (warm_start && eigvec && nev) guess.assign(eigvec.get(),eigvec.get()+size*nev);
 		if (option == 1 || option == 2) {
-			nev = size;
+			nev = (option == 2 && range == 'I') ? std::min(nev_in,size) : size;
 			_ham = ham->get_dense();
 			if (!clear_mat) {
 				// lapack deletes hamiltonian, keeping it
@@ -345,10 +1280,20 @@ public:
 				for (int i = 0; i < size*size; ++i) _ham_copy[i] = _ham[i];
 				ham->reset_ham(&_ham_copy);
 			}
-			_eig = new double[nev]{0};
+			_eig = new double[size]{0};
 			_eigvec = new double[size*nev]{0};
 			if (option == 1) ed_dgees(_ham,_eigvec,_eig,size);
-			else if (option == 2) ed_dsyevr(_ham,_eigvec,_eig,size);
+			else if (option == 2) {
+				size_t m = ed_dsyevr(_ham,_eigvec,_eig,size,range,vl,vu,1,nev);
+				if (m < nev) {
+					// Keep only the eigenvectors found in the window
+					double* ev = new double[size*m];
+					std::copy(_eigvec,_eigvec+size*m,ev);
+					delete [] _eigvec;
+					_eigvec = ev;
+				}
+				nev = m;
+			}
 			eigvec = return_uptr<double>(&_eigvec);
 			eig = return_uptr<double>(&_eig);
 			delete [] _ham;
@@ -360,21 +1305,114 @@ public:
 			ed_dsyev(_ham,_eig,size);
 			eigvec = return_uptr<double>(&_ham);
 			eig = return_uptr<double>(&_eig);
-		} else if (option == 4) {
+		} else if (option == 5 && range == 'V') {
+			std::vector<double> val, vec;
+			nev = ed_chfsi(ham,vec,val,size,vl,vu,nslice);
+			std::cout << "Spectrum slicing eigenvalues " << nev << ", size: " << size << std::endl;
+			_eig = new double[nev];
+			_eigvec = new double[size*nev];
+			std::copy(val.begin(),val.end(),_eig);
+			std::copy(vec.begin(),vec.end(),_eigvec);
+			eigvec = return_uptr<double>(&_eigvec);
+			eig = return_uptr<double>(&_eig);
+			if (clear_mat) ham->clear_mat();
+		} else if (option == 4 || option == 5) {
 			nev = std::min(nev_in,size/3);
 			std::cout << "Arpack Eigenvalues " << nev << ", size: " << size << std::endl;
 			_eig = new double[nev]{0};
 			_eigvec = new double[size*nev]{0};
-			ed_dsarpack(ham,_eigvec,_eig,size,nev);
+			ed_dsarpack(ham,_eigvec,_eig,size,nev,guess);
+			eigvec = return_uptr<double>(&_eigvec);
+			eig = return_uptr<double>(&_eig);
+			if (clear_mat) ham->clear_mat();
+		} else if (option == 6) {
+			nev = std::min(nev_in,size);
+			_eig = new double[nev]{0};
+			_eigvec = new double[size*nev]{0};
+			if (mpi_rows) {
+				// Local rows are solved together, every rank gets the full eigenvectors
+				size_t nl = ham->get_mat_dim();
+				std::vector<double> vl(nl*nev);
+				ed_trlanczos(ham,vl.data(),_eig,nl,nev);
+				ham->gather(vl.data(),_eigvec,nev);
+			} else ed_trlanczos(ham,_eigvec,_eig,size,nev,guess);
+			eigvec = return_uptr<double>(&_eigvec);
+			eig = return_uptr<double>(&_eig);
+			if (clear_mat) ham->clear_mat();
+		} else if (option == 7) {
+			nev = std::min(nev_in,size);
+			_eig = new double[nev]{0};
+			_eigvec = new double[size*nev]{0};
+			ed_davidson(ham,_eigvec,_eig,size,nev,guess);
 			eigvec = return_uptr<double>(&_eigvec);
 			eig = return_uptr<double>(&_eig);
 			if (clear_mat) ham->clear_mat();
 		} else throw std::invalid_argument("invalid diagonalize method");
+		guess = std::vector<double>();
 		return;
 	}
 	void init_einrange() {
 		einrange = std::vector<int>(nev,0); // Hopefully there are more elegant solutions in the future
 	}
+	bool compressed() const {return !zptr.empty();};
+	double store_bytes() const {
+		if (!compressed()) return eigvec ? 8.0*size*nev : 0;
+		return 8.0*zptr.size() + 4.0*zind.size() + 8.0*zval.size() + 4.0*zvalf.size();
+	}
+	void compress(double tol, bool single, double& discard, double& round) {
+		// Drops eigenvector coefficients |c| <= tol and/or keeps them in single precision,
+		// discard: largest weight dropped from a vector, round: largest rounding error
+		discard = 0, round = 0;
+		if (!eigvec || compressed()) return;
+		bool sparse = tol > 0;
+		zptr = std::vector<size_t>(nev+1,0);
+		for (size_t n = 0; n < nev; ++n) {
+			size_t cnt = 0;
+			if (sparse) for (size_t i = 0; i < size; ++i) cnt += std::abs(eigvec[n*size+i]) > tol;
+			else cnt = size;
+			zptr[n+1] = zptr[n] + cnt;
+		}
+		if (sparse) zind.reserve(zptr[nev]);
+		if (single) zvalf.reserve(zptr[nev]);
+		else zval.reserve(zptr[nev]);
+		for (size_t n = 0; n < nev; ++n) {
+			double w = 0;
+			for (size_t i = 0; i < size; ++i) {
+				double c = eigvec[n*size+i];
+				if (sparse && std::abs(c) <= tol) {
+					w += c*c;
+					continue;
+				}
+				if (sparse) zind.push_back(i);
+				if (single) {
+					zvalf.push_back(float(c));
+					round = std::max(round,std::abs(c-double(float(c))));
+				} else zval.push_back(c);
+			}
+			discard = std::max(discard,w);
+		}
+		eigvec.reset();
+	}
+	template <typename F>
+	void for_nonzero(size_t n, F f) const {
+		// Calls f(i,c) over the stored coefficients of eigenvector n
+		if (!compressed()) {
+			for (size_t i = 0; i < size; ++i) f(i,eigvec[n*size+i]);
+			return;
+		}
+		for (size_t k = zptr[n]; k < zptr[n+1]; ++k) {
+			f(zind.empty() ? k-zptr[n] : size_t(zind[k]), zvalf.empty() ? zval[k] : double(zvalf[k]));
+		}
+	}
+	void get_vec(size_t n, double* vec) const {
+		// Dense copy of eigenvector n
+		if (!compressed()) {
+			std::copy(&eigvec[n*size],&eigvec[n*size]+size,vec);
+			return;
+		}
+		std::fill(vec,vec+size,0);
+		for_nonzero(n,[&](size_t i, double c){vec[i] = c;});
+	}
 };
 
 #endif 
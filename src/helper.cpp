@@ -1,4 +1,5 @@
 #include "helper.hpp"
+#include <unistd.h>
 
 size_t ed::choose(size_t n, size_t k) {
 	if (k > n) return 0;
@@ -20,8 +21,8 @@ void ed::enum_states(std::vector<ulli>& states, ulli n, ulli k, ulli inc, ulli s
 		states.emplace_back(s);
 		return;
 	}
-	enum_states(states,n-1,k-1,inc,s+(1<<(n-1))); // bit is 1
-	if (!(inc & (1<<(n-1)))) enum_states(states,n-1,k,inc,s); // bit is 0
+	enum_states(states,n-1,k-1,inc,s+(BIG1<<(n-1))); // bit is 1
+	if (!(inc & (BIG1<<(n-1)))) enum_states(states,n-1,k,inc,s); // bit is 0
 }
 
 // Add valence state and core state 
@@ -64,6 +65,77 @@ std::vector<int> ed::distribute(int num_h, int num_at) {
 	return dist;
 }
 
+double ed::phys_mem() {
+	// Physical memory in bytes
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+	return double(sysconf(_SC_PHYS_PAGES))*sysconf(_SC_PAGESIZE);
+#else
+	return 1e12;
+#endif
+}
+
+#define MPI_CHUNK (size_t(1) << 30) // MPI counts are int, large buffers go in pieces
+void ed::mpi_init(int* argc, char*** argv) {
+#ifdef MPI_VERSION
+	int provided;
+	MPI_Init_thread(argc,argv,MPI_THREAD_FUNNELED,&provided);
+	// Only rank 0 prints
+	if (mpi_rank()) std::cout.setstate(std::ios_base::badbit);
+#endif
+	return;
+}
+
+void ed::mpi_finalize() {
+#ifdef MPI_VERSION
+	MPI_Finalize();
+#endif
+	return;
+}
+
+int ed::mpi_rank() {
+	int rank = 0;
+#ifdef MPI_VERSION
+	int init = 0;
+	MPI_Initialized(&init);
+	if (init) MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+#endif
+	return rank;
+}
+
+int ed::mpi_size() {
+	int size = 1;
+#ifdef MPI_VERSION
+	int init = 0;
+	MPI_Initialized(&init);
+	if (init) MPI_Comm_size(MPI_COMM_WORLD,&size);
+#endif
+	return size;
+}
+
+void ed::mpi_send(const void* buf, size_t bytes, int dest) {
+#ifdef MPI_VERSION
+	for (size_t i = 0; i < bytes; i += MPI_CHUNK)
+		MPI_Send((const char*)buf+i,std::min(MPI_CHUNK,bytes-i),MPI_BYTE,dest,0,MPI_COMM_WORLD);
+#endif
+	return;
+}
+
+void ed::mpi_recv(void* buf, size_t bytes, int src) {
+#ifdef MPI_VERSION
+	for (size_t i = 0; i < bytes; i += MPI_CHUNK)
+		MPI_Recv((char*)buf+i,std::min(MPI_CHUNK,bytes-i),MPI_BYTE,src,0,MPI_COMM_WORLD,MPI_STATUS_IGNORE);
+#endif
+	return;
+}
+
+void ed::mpi_bcast(void* buf, size_t bytes, int root) {
+#ifdef MPI_VERSION
+	for (size_t i = 0; i < bytes; i += MPI_CHUNK)
+		MPI_Bcast((char*)buf+i,std::min(MPI_CHUNK,bytes-i),MPI_BYTE,root,MPI_COMM_WORLD);
+#endif
+	return;
+}
+
 std::string ed::format_duration(std::chrono::milliseconds ms) {
     using namespace std::chrono;
     auto secs = duration_cast<seconds>(ms);
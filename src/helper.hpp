@@ -11,7 +11,9 @@
 #include <numeric>
 #include <memory>
 #include <chrono>
-// #include <mpi.h>
+#if defined __has_include && __has_include (<mpi.h>) 
+#include <mpi.h>
+#endif
 #ifndef HELPER
 #define HELPER
 
@@ -28,13 +30,17 @@ typedef std::vector<std::pair<ulli,ulli>> vpulli;
 #define BIG1 ulli(1)
 
 
+namespace ed {
+	int mpi_rank();
+}
+
 class multistream {
-// Custom stream class that can direct output to cout & fstream
+// Custom stream class that can direct output to cout & fstream, files are written by MPI rank 0
 public:
 	multistream(bool is_cout = true, std::string fname = "", std::string mode = "a") {
 		this->skip_cout = !is_cout;
 		this->write_cout = is_cout;
-		this->write_file = !fname.empty();
+		this->write_file = !fname.empty() && !ed::mpi_rank();
 		this->fname = fname;
 		if (write_file) set_mode(mode);
 		// if (write_file && mode == "a") file_stream = std::ofstream(fname,std::ios_base::app);
@@ -79,6 +85,15 @@ namespace ed {
 	vecc ctranspose(const vecc& mat, size_t m, size_t n);
 	std::vector<int> distribute(int num_h, int num_at);
 	std::string format_duration(std::chrono::milliseconds ms);
+	double phys_mem();
+	// MPI wrappers, without MPI there is a single rank and these do nothing
+	void mpi_init(int* argc, char*** argv);
+	void mpi_finalize();
+	int mpi_rank();
+	int mpi_size();
+	void mpi_send(const void* buf, size_t bytes, int dest);
+	void mpi_recv(void* buf, size_t bytes, int src);
+	void mpi_bcast(void* buf, size_t bytes, int root = 0);
 	void print_progress(double frac, double all);
 	void parse_num(std::string complex_string, dcomp& complex_num);
 
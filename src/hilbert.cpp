@@ -2,6 +2,8 @@
 #include <regex>
 #include <cmath>
 #include <bitset>
+#include <map>
+#include <climits>
 #include "hilbert.hpp"
 
 using namespace std;
@@ -46,49 +48,29 @@ Hilbert::Hilbert(string file_dir, const HParam& hparam, string edge, bool is_ex)
 			hblks.emplace_back(double(sz)/2,0,0,blksize,bfind,rank);
 			bfind += blksize;
 		}
-	} else if (false) {
-		// Jz ordered blocks, should not be used
+	} else if (hparam.block_diag && (jz_mod = jz_modulus(hparam)) != 2) {
+		// Jz ordered blocks, spin orbit coupling mixes Sz but conserves Jz
+		JZ_BLOCK = true;
 		hashfunc = &Hilbert::jz_Hash;
 		hbfunc = &Hilbert::jz_Hashback;
-		int min_2jz = 0, max_2jz = 0;
-		vector<ulli> hspace = enum_hspace();
-		vector<int> jz2_arr(hspace.size(),0);
-		for (auto & h : hspace) {
-			int jz2 = 0;
-			jz2 +=  ed::count_bits(h/(BIG1<<(hc+hv+1))) - ed::count_bits(h%(BIG1<<(hc+hv+1)));
-			for (auto & at : atlist) {
-				for (int i = at.sind; i <= at.eind; ++i) {
-					if (h & (BIG1<<i)) jz2 += 2*(i-at.sind-at.l);
-					if (h & (BIG1<<(i+hv+hc))) jz2 += 2*(i-at.sind-at.l);
-				}
-			}
-			jz2_arr[&h-&hspace[0]] = jz2;
-			if (jz2 < min_2jz) min_2jz = jz2;
-			if (jz2 > max_2jz) max_2jz = jz2;
-		}
-		// Calculate block size
-		vector<int> blk_size((max_2jz-min_2jz)/2+1,0);
-		for (int i = 0; i < hspace.size(); ++i) blk_size[(jz2_arr[i]-min_2jz)/2] += 1;
-		// Make Blocks
-		hblks.reserve(blk_size.size());
-		for (int j = min_2jz; j <= max_2jz; j += 2) {
-			hblks.emplace_back(0,double(j)/2,0,blk_size[(j-min_2jz)/2]);
-			bfind += blk_size[(j-min_2jz)/2];
-		}
-		for (int b = 0; b < hblks.size(); ++b) {
-			vector<ulli> rank;
-			for (int i = 0; i < hspace.size(); ++i) {
-				if ((jz2_arr[i]-min_2jz)/2 == b) rank.push_back(hspace[i]);
-			}
-			if (is_ex) std::sort(rank.begin(), rank.end(), std::greater<ulli>());
-			hblks[b].rank = std::move(rank);
-		}		
+		make_jz_blocks();
 	}
 	else {
 		hashfunc = &Hilbert::norm_Hash;
 		hbfunc = &Hilbert::norm_Hashback;
 		hblks.emplace_back(0,0,0,this->hsize);
 	}
+	// Hamiltonian is invariant under swapping spin labels, Sz < 0 blocks mirror the Sz > 0 blocks
+	SZ_FLIP = BLOCK_DIAG && hparam.sz_flip && hparam.s_target < 0;
+	if (BLOCK_DIAG && hparam.s_target >= 0) {
+		// Every total spin S multiplet has a member in the Sz = S block, only this block is kept
+		S_TARGET = hparam.s_target;
+		S_PENALTY = hparam.s_penalty;
+		if (none_of(hblks.begin(),hblks.end(),[&](Block<double>& b){return b.get_sz() == S_TARGET;}))
+			throw invalid_argument("no Sz = S block for the targeted total spin");
+	}
+	// Symmetry blocks, sites are identical and only coupled by translation invariant terms
+	if ((hparam.k_block || hparam.pg_block) && !JZ_BLOCK) make_sym_blocks(hparam);
 	// DEBUG
 	// vector<ulli> hspace = enum_hspace();
 	// if (is_ex) cout << "excited state" << endl;
@@ -173,20 +155,66 @@ vpulli Hilbert::match(int snum, QN* lhs, QN* rhs) {
 	vpulli mp;
 	ulli rhs_all = qn2ulli(snum,rhs), lhs_all = qn2ulli(snum,lhs);
 	ulli inc_all = rhs_all | lhs_all;
-	for (auto &s : ms) mp.emplace_back(pair<ulli,ulli>(s-inc_all+lhs_all,s-inc_all+rhs_all));
+	for (auto &s : ms) {
+		if (sz_skipped(s-inc_all+rhs_all)) continue;
+		mp.emplace_back(pair<ulli,ulli>(s-inc_all+lhs_all,s-inc_all+rhs_all));
+	}
 	return mp;
 }
 
 void Hilbert::fill_hblk(double const& matelem, ulli const& lhs, ulli const& rhs) {
+	if (sz_skipped(rhs)) return;
+	if (SYM_BLOCK) {
+		fill_symblk(matelem,lhs,rhs);
+		return;
+	}
 	// Find block index for lhs and rhs
 	bindex lind = Hash(lhs);
 	bindex rind = Hash(rhs);
-	if (lind.first == rind.first) 
-		hblks[lind.first].ham->fill_mat(lind.second,rind.second,matelem);
-	else throw out_of_range("invalid block matrix element entry");
+	if (lind.first != rind.first) throw out_of_range("invalid block matrix element entry");
+	// Blocks assembled on another rank are skipped
+	if (hblks[lind.first].ham) hblks[lind.first].ham->fill_mat(lind.second,rind.second,matelem);
 	return;
 }
 
+bool Hilbert::sz_active(double sz) {
+	// Blocks that are assembled and diagonalized
+	if (SZ_FLIP && sz < 0) return false;
+	if (S_TARGET >= 0 && sz != S_TARGET) return false;
+	return true;
+}
+
+bool Hilbert::blk_local(size_t b) {
+	// Block is assembled and diagonalized on this rank
+	return !mpi_ranks || hblks[b].owner == ed::mpi_rank();
+}
+
+void Hilbert::distribute_blocks() {
+	// Largest blocks first, each to the rank with the least work so far
+	if (!mpi_ranks) return;
+	vector<size_t> order;
+	for (size_t b = 0; b < hblks.size(); ++b) {
+		hblks[b].owner = 0;
+		if (sz_active(hblks[b].get_sz())) order.push_back(b);
+	}
+	auto cost = [&](size_t b) {return pow(double(hblks[b].size),3);};
+	stable_sort(order.begin(),order.end(),[&](size_t x, size_t y){return cost(x) > cost(y);});
+	vector<double> load(mpi_ranks,0);
+	for (auto b : order) {
+		int r = min_element(load.begin(),load.end()) - load.begin();
+		hblks[b].owner = r;
+		load[r] += cost(b);
+	}
+	return;
+}
+
+bool Hilbert::sz_skipped(ulli s) {
+	// State is in a block that is not assembled
+	if (!SZ_FLIP && S_TARGET < 0) return false;
+	int half = (num_corb+num_vorb)/2;
+	return !sz_active((num_vh + num_ch)/2.0 - ed::count_bits(s % (BIG1 << half)));
+}
+
 void Hilbert::print_bits(ulli state) {
 	// const int bitnum = (num_corb+num_vorb)*2;
 	cout << bitset<22>(state) << endl; // This is a bit crude
@@ -234,7 +262,7 @@ vector<double> Hilbert::get_all_eigval(bool is_err) {
 	int last_ind = 0;
 	for (auto & blk : hblks) {
 		if (blk.eig == nullptr) {
-			if (is_err) throw out_of_range("invalid access of eigval");
+			if (is_err && blk.nev) throw out_of_range("invalid access of eigval");
 		} else {
 			for (size_t i = 0; i < blk.nev; ++i) {
 				all_eig[last_ind] = blk.eig[i];
@@ -469,7 +497,7 @@ bindex Hilbert::sz_Hash(ulli s) {
 	size_t hc = num_corb/2, hv = num_vorb/2;
 	int nsd = ed::count_bits(s % (BIG1 << (hc+hv)));
 	int nsu = num_vh + num_ch - nsd;
-	int max_2sz = int(2*hblks.back().get_sz());
+	int max_2sz = int(2*plain_blocks().back().get_sz());
 	size_t blk_ind = (max_2sz-nsd+nsu)/2;
 	for (size_t i = 0; i < hc; ++i)
 		if (s & (BIG1 << i)) cind += ed::choose(i,++cnt_c);
@@ -481,13 +509,13 @@ bindex Hilbert::sz_Hash(ulli s) {
 	cnt_v = 0;
 	for (size_t i = 0; i < hv; ++i)
 		if (s & (BIG1 << (i+num_corb+hv))) vsuind += ed::choose(i,++cnt_v);
-	return bindex(blk_ind,hblks[blk_ind].rank[cind]+vsdind+vsuind*vsdchoose);
+	return bindex(blk_ind,plain_blocks()[blk_ind].rank[cind]+vsdind+vsuind*vsdchoose);
 }
 
 ulli Hilbert::sz_Hashback(bindex ind) {
 	// Hashback function that uses sz as main QN
-	int max_2sz = int(2*hblks.back().get_sz());
-	auto& blk = hblks[ind.first];
+	int max_2sz = int(2*plain_blocks().back().get_sz());
+	auto& blk = plain_blocks()[ind.first];
 	auto r = std::find_if(blk.rank.rbegin(), blk.rank.rend(),
 				[&](size_t e){return (e >= 0) && (ind.second >= e);});
 	if (r == blk.rank.rend()) r = blk.rank.rend() - 1;
@@ -516,24 +544,611 @@ ulli Hilbert::sz_Hashback(bindex ind) {
 	return ed::add_bits(vsd|(vsu<<hv),c,num_vorb,num_corb);
 }
 
-bindex Hilbert::jz_Hash(ulli s) {
-	// Hash function that uses jz as main QN
-	int hv = num_vorb/2, hc = num_corb/2;
-	int min_2jz = int(2*hblks[0].get_jz()), jz2 = 0;
-	jz2 +=  ed::count_bits(s/(BIG1<<(hc+hv+1))) - ed::count_bits(s%(BIG1<<(hc+hv+1)));
-	for (auto & at : atlist) {
-		for (int i = at.sind; i <= at.eind; ++i) {
-			if (s & (BIG1<<i)) jz2 += 2*(i-at.sind-at.l);
-			if (s & (BIG1<<(i+hv+hc))) jz2 += 2*(i-at.sind-at.l);
+int Hilbert::jz_modulus(const HParam& hparam) {
+	// Coulomb, spin orbit and core valence terms conserve Jz, crystal field and hybridization
+	// only conserve 2Jz modulo the common step of their hoppings (0: Jz is a good quantum number)
+	int mod = 0;
+	auto add_step = [&](int step) {
+		step = abs(step);
+		while (step) {
+			int t = mod % step;
+			mod = step;
+			step = t;
+		}
+	};
+	if (CF_on) {
+		for (auto& at : atlist) {
+			if (at.l != 2 || at.is_lig) continue;
+			// See CFmat, (CF[0]-CF[2]) mixes ml = +-2, (CF[4]-CF[3]) mixes ml = +-1
+			if (hparam.CF[0] != hparam.CF[2]) add_step(8);
+			if (hparam.CF[3] != hparam.CF[4]) add_step(4);
+		}
+	}
+	if (HYB_on && !cluster->no_HYB) {
+		cluster->set_hyb_params(hparam);
+		int nvo = cluster->vo_persite * tot_site_num();
+		int nco = cluster->co_persite * tot_site_num();
+		vecd hybmat = ed::make_blk_mat(cluster->get_tmat_real(),tot_site_num());
+		vector<int> ml(nvo,0);
+		for (auto& at : atlist) {
+			for (int i = at.sind; i <= at.eind; ++i) 
+				if (i >= nco && i < nvo+nco) ml[i-nco] = at.val_l - i + at.sind;
+		}
+		for (int i = 0; i < nvo; ++i)
+			for (int j = 0; j < nvo; ++j)
+				if (abs(hybmat[i*nvo+j]) > TOL) add_step(2*(ml[i]-ml[j]));
+	}
+	return mod;
+}
+
+int Hilbert::jz_half(ulli x, bool up) {
+	// 2Jz carried by the holes of a half state
+	int jz2 = up ? 2*ed::count_bits(x) : 0;
+	for (; x; x &= x - 1) jz2 += jz_orb[__builtin_ctzll(x)];
+	return jz2;
+}
+
+size_t Hilbert::half_rank(ulli x) {
+	// Colex rank of a half state among half states with the same number of holes
+	size_t r = 0, cnt = 0;
+	for (ulli y = x; y; y &= y - 1) r += ed::choose(__builtin_ctzll(y),++cnt);
+	return jz_koff[cnt] + r;
+}
+
+size_t Hilbert::jz_upkey(int k, int nc, int c) {
+	return (size_t(k)*(num_corb/2+1) + nc)*jz_ncls + (c - jz_cmin);
+}
+
+void Hilbert::make_jz_blocks() {
+	int hc = num_corb/2, half = (num_corb+num_vorb)/2, nh = num_ch + num_vh;
+	int kmax = min(nh,half);
+	ulli cmask = (BIG1 << hc) - 1;
+	jz_orb = vector<int>(half,0);
+	for (auto& at : atlist)
+		for (int i = at.sind; i <= at.eind; ++i) jz_orb[i] = 2*(at.l-i+at.sind) - 1;
+	// Enumerate all half states with up to kmax holes, in rank order
+	jz_koff = vector<size_t>(kmax+2,0);
+	for (int k = 0; k <= kmax; ++k) jz_koff[k+1] = jz_koff[k] + ed::choose(half,k);
+	vector<ulli> halves;
+	halves.reserve(jz_koff[kmax+1]);
+	for (int k = 0; k <= kmax; ++k) {
+		ulli x = (BIG1 << k) - 1;
+		for (size_t i = 0; i < ed::choose(half,k); ++i) {
+			halves.push_back(x);
+			if (i+1 < ed::choose(half,k)) x = ed::next_perm(x);
+		}
+	}
+	// Classify spin up halves by (holes, core holes, 2Jz class)
+	int cmax = jz_mod - 1;
+	jz_cmin = 0;
+	if (!jz_mod) {
+		jz_cmin = INT_MAX, cmax = INT_MIN;
+		for (auto& x : halves) {
+			jz_cmin = min(jz_cmin,jz_half(x,true));
+			cmax = max(cmax,jz_half(x,true));
 		}
 	}
-	size_t bind = (jz2-min_2jz)/2;
-	return bindex(bind,ed::binary_search(hblks[bind].rank,s,
-						std::less<ulli>(),std::equal_to<ulli>()));
+	jz_ncls = cmax - jz_cmin + 1;
+	jz_upclass = vector<vector<ulli>>((kmax+1)*(hc+1)*jz_ncls);
+	jz_upind = vector<size_t>(halves.size(),0);
+	for (size_t r = 0; r < halves.size(); ++r) {
+		auto& upc = jz_upclass[jz_upkey(ed::count_bits(halves[r]),
+						ed::count_bits(halves[r] & cmask),jz_cls(jz_half(halves[r],true)))];
+		jz_upind[r] = upc.size();
+		upc.push_back(halves[r]);
+	}
+	// Assign offset of every spin down half in each block, blocks are ordered by 2Jz class
+	map<int,vector<ulli>> blk_rank;
+	map<int,vector<pair<ulli,ulli>>> blk_dnlist;
+	map<int,size_t> blk_size;
+	for (size_t r = 0; r < halves.size(); ++r) {
+		ulli a = halves[r];
+		int kb = nh - ed::count_bits(a), ncb = num_ch - ed::count_bits(a & cmask);
+		if (kb < 0 || kb > kmax || ncb < 0 || ncb > hc) continue;
+		int jza = jz_half(a,false);
+		for (int cb = jz_cmin; cb <= cmax; ++cb) {
+			auto& upc = jz_upclass[jz_upkey(kb,ncb,cb)];
+			if (upc.empty()) continue;
+			int c = jz_cls(jza+cb);
+			if (!blk_rank.count(c)) blk_rank[c] = vector<ulli>(halves.size(),-1);
+			blk_rank[c][r] = blk_size[c];
+			blk_dnlist[c].emplace_back(blk_size[c],a);
+			blk_size[c] += upc.size();
+		}
+	}
+	int bcmin = blk_size.begin()->first, bcmax = blk_size.rbegin()->first;
+	jz_blkind = vector<long>(bcmax-bcmin+1,-1);
+	hblks.reserve(blk_size.size());
+	size_t bfind = 0;
+	for (auto& bs : blk_size) {
+		jz_blkind[bs.first-bcmin] = hblks.size();
+		jz_dnlist.emplace_back(std::move(blk_dnlist[bs.first]));
+		hblks.emplace_back(0,double(bs.first)/2,0,bs.second,bfind,std::move(blk_rank[bs.first]));
+		bfind += bs.second;
+	}
+	if (bfind != hsize) throw runtime_error("Jz blocks do not span the Hilbert space");
+	cout << (is_ex ? "Core-hole" : "Ground") << " state Jz blocks: " << hblks.size();
+	if (jz_mod) cout << " (2Jz conserved modulo " << jz_mod << ")";
+	cout << endl;
+	return;
+}
+
+bindex Hilbert::jz_Hash(ulli s) {
+	// Hash function that uses jz as main QN
+	int half = (num_corb+num_vorb)/2;
+	ulli a = s & ((BIG1 << half) - 1), b = s >> half;
+	int c = jz_cls(jz_half(a,false)+jz_half(b,true));
+	size_t bind = jz_blkind[c-lround(2*hblks[0].get_jz())];
+	return bindex(bind,hblks[bind].rank[half_rank(a)]+jz_upind[half_rank(b)]);
 }
 
 ulli Hilbert::jz_Hashback(bindex ind) {
 	// Hashback function that uses jz as main QN
-	return hblks[ind.first].rank[ind.second];
+	int hc = num_corb/2, half = (num_corb+num_vorb)/2;
+	auto& dl = jz_dnlist[ind.first];
+	auto it = upper_bound(dl.begin(),dl.end(),ind.second,
+				[](size_t i, const pair<ulli,ulli>& d){return i < d.first;}) - 1;
+	ulli a = it->second;
+	int kb = num_ch + num_vh - ed::count_bits(a);
+	int ncb = num_ch - ed::count_bits(a & ((BIG1 << hc) - 1));
+	int cb = jz_cls(int(lround(2*hblks[ind.first].get_jz())) - jz_half(a,false));
+	return a | (jz_upclass[jz_upkey(kb,ncb,cb)][ind.second-it->first] << half);
+}
+
+pair<ulli,double> Hilbert::sym_op(ulli s, int j) {
+	// Transformed state and sign from orbital phases and reordering the holes
+	const vector<int>& p = sym_perm[j];
+	int img[64], n = 0, inv = ed::count_bits(s & sym_neg[j]);
+	ulli t = 0;
+	for (; s; s &= s - 1) {
+		img[n] = p[__builtin_ctzll(s)];
+		for (int m = 0; m < n; ++m) inv += (img[m] > img[n]);
+		t |= BIG1 << img[n++];
+	}
+	return {t, (inv % 2) ? -1.0 : 1.0};
+}
+
+ulli Hilbert::sym_orbit(ulli s, int& j, double& sign) {
+	// Representative (smallest state) of the orbit, g_j s = sign * representative
+	ulli r = s;
+	j = 0, sign = 1;
+	for (int i = 1; i < sym_perm.size(); ++i) {
+		auto t = sym_op(s,i);
+		if (t.first < r) r = t.first, j = i, sign = t.second;
+	}
+	return r;
+}
+
+double Hilbert::sym_phase(int c, int j) {
+	// Character of element j in class c is exp(i*phase)
+	double th = M_PI*(ed::count_bits(sym_irr[c] & sym_pg[j]) % 2);
+	for (int d = 0; d < 3; ++d) th += 2*M_PI*sym_mom[c][d]*sym_trans[j][d]/sites[d];
+	return th;
+}
+
+int Hilbert::sym_sector(ulli s) {
+	return Hash(s).first;
+}
+
+bool Hilbert::pg_generator(int gen, const vecd& hybmat, vector<int>& perm, ulli& neg) {
+	// D2h generators (0: C2z, 1: mirror xz, 2: mirror xy) flip the sign of real orbitals, in the
+	// spherical harmonics basis they map ml to +-ml with a sign. Ligand orbitals are combinations
+	// of ligand atoms and may pick up an extra sign, the generator is kept if a choice of these
+	// signs commutes with the hybridization
+	int half = (num_corb+num_vorb)/2, nco = num_corb/2, nvo = num_vorb/2;
+	int sx = (gen == 0) ? -1 : 1, sy = (gen == 2) ? 1 : -1, sz = (gen == 2) ? -1 : 1;
+	vector<vector<int>> rsgn = {{1},{sx,sy,sz},{1,1,sx*sy,sx*sz,sy*sz}};
+	vector<vector<pair<int,int>>> mlop(3); // (image, sign) of each ml index for s, p, d
+	for (int l = 0; l < 3; ++l) {
+		int n = 2*l+1;
+		vecc U = cluster->get_ylm2real_mat(l);
+		for (int m = 0; m < n; ++m) {
+			mlop[l].emplace_back(-1,0);
+			for (int mp = 0; mp < n; ++mp) {
+				dcomp o = 0;
+				for (int r = 0; r < n; ++r) o += conj(U[r*n+mp]) * double(rsgn[l][r]) * U[r*n+m];
+				if (abs(o) < TOL) continue;
+				if (mlop[l][m].first != -1 || abs(abs(o.real())-1) > TOL) return false;
+				mlop[l][m] = {mp, o.real() > 0 ? 1 : -1};
+			}
+		}
+	}
+	vector<int> lig;
+	for (auto& at : atlist) {
+		int loc = at.atind % at_per_site;
+		if (at.l > 2) return false;
+		if (at.is_lig && find(lig.begin(),lig.end(),loc) == lig.end()) lig.push_back(loc);
+	}
+	for (int lmask = 0; lmask < (1 << lig.size()); ++lmask) {
+		perm = vector<int>(2*half,0);
+		vector<int> sgn(half,1);
+		for (auto& at : atlist) {
+			int ls = 1;
+			for (size_t b = 0; b < lig.size(); ++b) 
+				if (at.is_lig && lig[b] == at.atind % at_per_site && (lmask >> b) & 1) ls = -1;
+			for (int i = at.sind; i <= at.eind; ++i) {
+				auto& o = mlop[at.l][i-at.sind];
+				perm[i] = at.sind + o.first;
+				perm[i+half] = perm[i] + half;
+				sgn[i] = ls * o.second;
+			}
+		}
+		bool comm = true;
+		for (int i = 0; i < nvo && comm; ++i) 
+			for (int j = 0; j < nvo && comm; ++j) {
+				double h = hybmat[(perm[i+nco]-nco)*nvo+perm[j+nco]-nco]*sgn[i+nco]*sgn[j+nco];
+				if (abs(h-hybmat[i*nvo+j]) > TOL) comm = false;
+			}
+		if (!comm) continue;
+		neg = 0;
+		for (int i = 0; i < half; ++i) if (sgn[i] < 0) neg |= (BIG1 << i | BIG1 << (i+half));
+		return true;
+	}
+	return false;
+}
+
+void Hilbert::make_sym_blocks(const HParam& hparam) {
+	// Split every Sz (or the single) block with translations of the sites and point group operations
+	int L = (hparam.k_block && tot_site_num() > 1) ? tot_site_num() : 1;
+	int half = (num_corb+num_vorb)/2;
+	vector<vector<int>> gperm;
+	vector<ulli> gneg;
+	if (hparam.pg_block && BLOCK_DIAG) {
+		int nvo = num_vorb/2;
+		vecd hybmat(nvo*nvo,0);
+		if (HYB_on && !cluster->no_HYB) {
+			cluster->set_hyb_params(hparam);
+			hybmat = ed::make_blk_mat(cluster->get_tmat_real(),tot_site_num());
+		}
+		for (int gen = 0; gen < 3; ++gen) {
+			vector<int> perm;
+			ulli neg;
+			if (!pg_generator(gen,hybmat,perm,neg)) continue;
+			sym_gens.push_back(gen);
+			gperm.push_back(perm);
+			gneg.push_back(neg);
+		}
+	}
+	int npg = 1 << sym_gens.size();
+	if (L * npg == 1) return;
+	for (int t = 0; t < L; ++t) {
+		vector<int> tv = {t/(sites[1]*sites[2]), (t/sites[2])%sites[1], t%sites[2]};
+		vector<int> p(2*half,0);
+		for (auto& at : atlist) {
+			int s = at.atind/at_per_site, loc = at.atind%at_per_site;
+			int sx = (s/(sites[1]*sites[2])+tv[0])%sites[0];
+			int sy = ((s/sites[2])%sites[1]+tv[1])%sites[1];
+			int sz = (s%sites[2]+tv[2])%sites[2];
+			int tind = ((sx*sites[1]+sy)*sites[2]+sz)*at_per_site+loc;
+			auto tat = find_if(atlist.begin(),atlist.end(),
+						[&](const Atom& a){return a.atind == tind && a.is_val == at.is_val;});
+			for (int i = at.sind; i <= at.eind; ++i) {
+				p[i] = tat->sind + i - at.sind;
+				p[i+half] = p[i] + half;
+			}
+		}
+		for (int g = 0; g < npg; ++g) {
+			// Point group operations first, then translation
+			vector<int> q(2*half);
+			ulli neg = 0;
+			for (int i = 0; i < 2*half; ++i) {
+				int o = i;
+				bool sg = false;
+				for (size_t b = 0; b < sym_gens.size(); ++b) {
+					if (!((g >> b) & 1)) continue;
+					sg ^= (gneg[b] >> o) & 1;
+					o = gperm[b][o];
+				}
+				q[i] = p[o];
+				if (sg) neg |= BIG1 << i;
+			}
+			sym_trans.push_back(tv);
+			sym_pg.push_back(g);
+			sym_perm.push_back(q);
+			sym_neg.push_back(neg);
+		}
+	}
+	// Classes: pair up k and -k, point group irreps are real
+	for (int t = 0; t < L; ++t) {
+		int mt = 0;
+		vector<int> k = sym_trans[t*npg];
+		for (int d = 0; d < 3; ++d) mt = mt*sites[d] + (sites[d]-k[d])%sites[d];
+		if (mt < t) continue;
+		for (int e = 0; e < npg; ++e) {
+			sym_mom.push_back(k);
+			sym_irr.push_back(e);
+			sym_selfconj.push_back(mt == t);
+		}
+	}
+	int nc = sym_mom.size(), ns = hblks.size(), G = sym_perm.size();
+	sym_reps = vector<vector<ulli>>(ns);
+	sym_stab = vector<vector<int>>(ns);
+	sym_bind = vector<vector<vector<long>>>(ns,vector<vector<long>>(nc));
+	sym_blk = vector<vector<long>>(ns,vector<long>(nc,-1));
+	vector<Block<double>> sblks;
+	size_t bfind = 0;
+	for (int p = 0; p < ns; ++p) {
+		for (size_t i = 0; i < hblks[p].size; ++i) {
+			ulli s = Hashback(bindex(p,i));
+			int j;
+			double sign;
+			if (sym_orbit(s,j,sign) == s) sym_reps[p].push_back(s);
+		}
+		sort(sym_reps[p].begin(),sym_reps[p].end());
+		vector<size_t> cnt(nc,0);
+		for (auto& s : sym_reps[p]) {
+			// Representative belongs to a class if the stabilizer characters match the signs
+			vector<bool> comp(nc,true);
+			int g = 0;
+			for (int l = 0; l < G; ++l) {
+				auto t = sym_op(s,l);
+				if (t.first != s) continue;
+				g++;
+				for (int c = 0; c < nc; ++c) 
+					if (cos(sym_phase(c,l))*t.second < 0.5) comp[c] = false;
+			}
+			sym_stab[p].push_back(g);
+			for (int c = 0; c < nc; ++c) {
+				if (!comp[c]) sym_bind[p][c].push_back(-1);
+				else {
+					sym_bind[p][c].push_back(cnt[c]);
+					cnt[c] += sym_selfconj[c] ? 1 : 2;
+				}
+			}
+		}
+		for (int c = 0; c < nc; ++c) {
+			if (!cnt[c]) continue;
+			sym_blk[p][c] = sblks.size();
+			sblks.emplace_back(hblks[p].get_sz(),hblks[p].get_jz(),c,cnt[c],bfind);
+			bfind += cnt[c];
+		}
+	}
+	if (bfind != hsize) throw runtime_error("symmetry blocks do not span the Hilbert space");
+	plain_blks.swap(hblks);
+	hblks.swap(sblks);
+	SYM_BLOCK = true;
+	cout << (is_ex ? "Core-hole" : "Ground") << " state symmetry blocks: " << hblks.size() << " (";
+	if (L > 1) cout << "translations on " << sites[0] << "x" << sites[1] << "x" << sites[2] << " sites";
+	if (L > 1 && npg > 1) cout << ", ";
+	if (npg > 1) cout << "point group of order " << npg;
+	cout << ")" << endl;
+	return;
+}
+
+void Hilbert::fill_symblk(double matelem, ulli lhs, ulli rhs) {
+	// <r',c|H|r,c> = sum over s in orbit of r' of <s|H|r> * sign * conj(chi_c(g)) * sqrt(stab_r'/stab_r),
+	// where g s = sign * r'. Only columns of representatives are needed.
+	int jr, jl;
+	double sr, sl;
+	if (sym_orbit(rhs,jr,sr) != rhs) return;
+	ulli lrep = sym_orbit(lhs,jl,sl);
+	int p = sym_sector(rhs);
+	if (sym_sector(lhs) != p) throw out_of_range("invalid block matrix element entry");
+	auto& reps = sym_reps[p];
+	size_t rr = lower_bound(reps.begin(),reps.end(),rhs) - reps.begin();
+	size_t rl = lower_bound(reps.begin(),reps.end(),lrep) - reps.begin();
+	double factor = matelem * sl * sqrt(double(sym_stab[p][rl])/sym_stab[p][rr]);
+	for (int c = 0; c < sym_mom.size(); ++c) {
+		long bl = sym_bind[p][c][rl], br = sym_bind[p][c][rr];
+		if (bl < 0 || br < 0) continue;
+		Matrix<double>* ham = hblks[sym_blk[p][c]].ham;
+		if (!ham) continue; // Assembled on another rank
+		double th = -sym_phase(c,jl), a = factor*cos(th), b = factor*sin(th);
+		if (sym_selfconj[c]) {
+			ham->fill_mat(bl,br,a);
+			continue;
+		}
+		// Real basis c = (|k>+|-k>)/sqrt(2), s = (|k>-|-k>)/(i*sqrt(2))
+		ham->fill_mat(bl,br,a);
+		ham->fill_mat(bl+1,br+1,a);
+		if (abs(b) < TOL) continue;
+		ham->fill_mat(bl,br+1,b);
+		ham->fill_mat(bl+1,br,-b);
+	}
+	return;
+}
+
+void Hilbert::unfold_sym_blocks() {
+	// Expand eigenvectors of symmetry blocks back into the plain blocks, eigenvalues sorted per block
+	if (!SYM_BLOCK) return;
+	int G = sym_perm.size();
+	for (int p = 0; p < plain_blks.size(); ++p) {
+		auto& pb = plain_blks[p];
+		if (!sz_active(pb.get_sz())) {
+			pb.nev = 0;
+			continue;
+		}
+		vector<tuple<double,long,size_t>> eigs;
+		for (int c = sym_mom.size()-1; c >= 0; --c) 
+			if (sym_blk[p][c] >= 0) pb.diag_option = hblks[sym_blk[p][c]].diag_option;
+		for (int c = 0; c < sym_mom.size(); ++c) {
+			long b = sym_blk[p][c];
+			if (b < 0) continue;
+			for (size_t e = 0; e < hblks[b].nev; ++e) eigs.emplace_back(hblks[b].eig[e],c,e);
+		}
+		if (eigs.empty()) {
+			// No sector kept an eigenpair, e.g. outside of a 'V' window
+			pb.nev = 0;
+			continue;
+		}
+		stable_sort(eigs.begin(),eigs.end(),
+			[](const tuple<double,long,size_t>& x, const tuple<double,long,size_t>& y){return get<0>(x) < get<0>(y);});
+		// Index and sign of every transformed representative
+		auto& reps = sym_reps[p];
+		vector<size_t> tind(reps.size()*G);
+		vector<double> tsign(reps.size()*G);
+		for (size_t r = 0; r < reps.size(); ++r) {
+			for (int j = 0; j < G; ++j) {
+				auto t = sym_op(reps[r],j);
+				tind[r*G+j] = Hash(t.first).second;
+				tsign[r*G+j] = t.second;
+			}
+		}
+		pb.nev = eigs.size();
+		pb.eig = uptrd(new double[pb.nev]);
+		pb.eigvec = uptrd(new double[pb.nev*pb.size]{0});
+		pb.eigsym = vector<int>(pb.nev,0);
+		#pragma omp parallel for
+		for (size_t n = 0; n < eigs.size(); ++n) {
+			int c = get<1>(eigs[n]);
+			auto& sb = hblks[sym_blk[p][c]];
+			double* v = &sb.eigvec[get<2>(eigs[n])*sb.size];
+			double* w = &pb.eigvec[n*pb.size];
+			pb.eig[n] = get<0>(eigs[n]);
+			pb.eigsym[n] = c;
+			for (size_t r = 0; r < reps.size(); ++r) {
+				long bi = sym_bind[p][c][r];
+				if (bi < 0) continue;
+				double norm = sqrt(double(sym_stab[p][r])/G);
+				for (int j = 0; j < G; ++j) {
+					double th = sym_phase(c,j), x;
+					if (sym_selfconj[c]) x = v[bi]*cos(th);
+					else x = sqrt(2)*(v[bi]*cos(th) - v[bi+1]*sin(th));
+					w[tind[r*G+j]] = norm*tsign[r*G+j]*x;
+				}
+			}
+		}
+	}
+	hblks.swap(plain_blks);
+	plain_blks.clear();
+	SYM_BLOCK = false;
+	return;
+}
+
+void Hilbert::mirror_sz_blocks() {
+	// Fill the Sz < 0 blocks from their Sz > 0 mirrors by swapping the spin down and spin up halves
+	// of every state, the reordering sign is the same for the whole block and is dropped
+	if (!SZ_FLIP) return;
+	int half = (num_corb+num_vorb)/2;
+	size_t nb = hblks.size();
+	for (size_t b = 0; b < nb/2; ++b) {
+		auto& mb = hblks[b];
+		auto& sb = hblks[nb-1-b];
+		vector<ulli> slist = get_hashback_list(nb-1-b);
+		vector<size_t> mind(sb.size);
+		#pragma omp parallel for
+		for (size_t i = 0; i < sb.size; ++i) {
+			ulli s = slist[i];
+			mind[i] = Hash((s >> half) | ((s % (BIG1 << half)) << half)).second;
+		}
+		mb.nev = sb.nev;
+		mb.diag_option = sb.diag_option;
+		mb.eigsym = sb.eigsym;
+		mb.eig = uptrd(new double[mb.nev]);
+		mb.eigvec = uptrd(new double[mb.nev*mb.size]);
+		copy(&sb.eig[0],&sb.eig[0]+sb.nev,&mb.eig[0]);
+		#pragma omp parallel for
+		for (size_t n = 0; n < mb.nev; ++n)
+			for (size_t i = 0; i < sb.size; ++i) mb.eigvec[n*mb.size+mind[i]] = sb.eigvec[n*sb.size+i];
+	}
+	return;
+}
+
+void Hilbert::trim_spin_target() {
+	// Higher spin states are pushed up by at least 2*S_PENALTY, drop them
+	if (S_TARGET < 0) return;
+	double emin = min_eigval();
+	size_t kept = 0;
+	for (auto& blk : hblks) {
+		if (blk.eig == nullptr) continue;
+		size_t n = 0;
+		while (n < blk.nev && blk.eig[n] < emin + S_PENALTY) ++n;
+		blk.nev = n;
+		kept += n;
+	}
+	cout << "Eigenstates with total spin S = " << S_TARGET << ": " << kept << endl;
+	return;
+}
+
+double Hilbert::min_eigval() {
+	// Lowest eigenvalue of all diagonalized blocks
+	auto all_eig = get_all_eigval(true);
+	if (all_eig.empty()) throw runtime_error("Hamiltonian not diagonalized");
+	return *min_element(all_eig.begin(),all_eig.end());
+}
+
+void Hilbert::index_eigval() {
+	// Sorts the eigenvalues of all blocks once and groups them into degenerate levels
+	eig_sorted.clear();
+	eig_levels.clear();
+	level_en.clear();
+	for (size_t b = 0; b < hblks.size(); ++b) {
+		if (hblks[b].eig == nullptr) continue;
+		for (size_t i = 0; i < hblks[b].nev; ++i) eig_sorted.push_back({hblks[b].eig[i],bindex(b,i)});
+	}
+	sort(eig_sorted.begin(),eig_sorted.end());
+	size_t rep = 0;
+	for (size_t n = 0; n < eig_sorted.size(); ++n) {
+		if (!eig_levels.empty() && eig_sorted[n].first-eig_sorted[eig_levels.back()].first < TOL) {
+			if (eig_sorted[n].second < eig_sorted[rep].second) rep = n;
+			continue;
+		}
+		if (!eig_levels.empty()) level_en.push_back(eig_sorted[rep].first);
+		eig_levels.push_back(n);
+		rep = n;
+	}
+	if (!eig_levels.empty()) level_en.push_back(eig_sorted[rep].first);
+	eig_levels.push_back(eig_sorted.size());
+	return;
+}
+
+size_t Hilbert::level_count() {
+	if (eig_levels.empty()) index_eigval();
+	return level_en.size();
+}
+
+vector<bindex> Hilbert::level_states(size_t u) {
+	// States of the u-th level, in block order
+	if (eig_levels.empty()) index_eigval();
+	vector<bindex> states;
+	for (size_t n = eig_levels[u]; n < eig_levels[u+1]; ++n) states.push_back(eig_sorted[n].second);
+	sort(states.begin(),states.end());
+	return states;
+}
+
+vector<bindex> Hilbert::eig_near(double en, double tol) {
+	// States with |E - en| < tol, in block order
+	if (eig_levels.empty()) index_eigval();
+	vector<bindex> states;
+	auto it = lower_bound(eig_sorted.begin(),eig_sorted.end(),en-2*tol,
+				[](const pair<double,bindex>& a, double e){return a.first < e;});
+	for (; it != eig_sorted.end() && it->first < en+2*tol; ++it) {
+		if (abs(it->first-en) < tol) states.push_back(it->second);
+	}
+	sort(states.begin(),states.end());
+	return states;
+}
+
+int Hilbert::op_irrep(const function<dcomp(ulli,ulli)>& amp) {
+	// Point group irrep of a core-valence one body operator with amplitudes amp(core, valence),
+	// -1 if it does not transform as a single irrep
+	if (sym_gens.empty()) return -1;
+	int nco = num_corb/2, half = (num_corb+num_vorb)/2, irr = 0;
+	for (size_t b = 0; b < sym_gens.size(); ++b) {
+		auto& p = sym_perm[1 << b];
+		int chi = 0;
+		for (int c = 0; c < nco; ++c) {
+			for (int v = nco; v < half; ++v) {
+				dcomp a = amp(BIG1 << c,BIG1 << v);
+				if (abs(a) < TOL) continue;
+				double sg = (((sym_neg[1 << b] >> c) ^ (sym_neg[1 << b] >> v)) & 1) ? -1 : 1;
+				dcomp ta = sg * amp(BIG1 << p[c],BIG1 << p[v]);
+				int x = (abs(ta-a) < TOL) ? 1 : (abs(ta+a) < TOL) ? -1 : 0;
+				if (!x || (chi && x != chi)) return -1;
+				chi = x;
+			}
+		}
+		if (chi < 0) irr |= 1 << b;
+	}
+	return irr;
+}
 
+bool Hilbert::dipole_allowed(Hilbert& EX, const bindex& g, const bindex& e, int irrep) {
+	// Selection rule between symmetry classes, the operator keeps k and has the given irrep
+	auto& gs = hblks[g.first].eigsym;
+	auto& ex = EX.hblks[e.first].eigsym;
+	if (gs.empty() || ex.empty() || sym_gens != EX.sym_gens) return true;
+	int gc = gs[g.second], ec = ex[e.second];
+	if (sym_mom[gc] != EX.sym_mom[ec]) return false;
+	return irrep < 0 || (sym_irr[gc] ^ irrep) == EX.sym_irr[ec];
 }
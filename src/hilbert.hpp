@@ -1,3 +1,4 @@
+#include <functional>
 #include "diagonalize.hpp"
 #include "cluster.hpp"
 #ifndef HILBERT
@@ -12,10 +13,17 @@ public:
 	int val_ati = 0, val_ind = 0; // Index/Orbital index of first valence atom
 	int num_ch = 0, num_vh = 0, num_corb = 0, num_vorb = 0; // This is number of orbital*2 (number of electron sites)
 	bool SO_on = false, CV_on = false, CF_on = false, HYB_on = false;
-	bool is_ex, BLOCK_DIAG = false;
+	bool is_ex, BLOCK_DIAG = false, JZ_BLOCK = false, SYM_BLOCK = false, SZ_FLIP = false;
+	double S_TARGET = -1, S_PENALTY = 0; // Total spin targeted in the Sz = S block, -1 if off
+	int jz_mod = 0; // 2Jz is conserved modulo jz_mod, 0 if it is fully conserved
+	int mpi_ranks = 0; // Blocks are spread over this many MPI ranks and gathered on rank 0, 0 if off
+	bool mpi_rows = false; // Rows of every block are spread over all MPI ranks
 	std::string coord = "none", edge, inp_hyb_file;
 	std::vector<Atom> atlist; // atlist is ordered
 	std::vector<Block<double>> hblks;
+	std::vector<std::pair<double,bindex>> eig_sorted; // Eigenvalues of all blocks, ascending
+	std::vector<size_t> eig_levels; // First entry of each level (within TOL of its lowest), + size
+	std::vector<double> level_en;	// Energy of each level, from its first state in block order
 	std::vector<int> sites = {1,1,1};
 	using Hashptr = bindex (Hilbert::*)(ulli s);
 	using HBptr = ulli (Hilbert::*)(bindex ind);
@@ -33,6 +41,10 @@ public:
 	ulli qn2ulli(int snum, QN* qn, bool only_val = false, bool only_core = false);
 	vpulli match(int snum, QN* lhs, QN* rhs);
 	void fill_hblk(double const& matelem, ulli const& lhs, ulli const& rhs);
+	bool sz_active(double sz);
+	bool blk_local(size_t b);
+	void distribute_blocks();
+	bool sz_skipped(ulli s);
 	void print_bits(ulli state);
 	double Fsign(QN* op, ulli state, int opnum);
 	double Fsign(ulli* op, ulli state, int opnum);
@@ -45,6 +57,19 @@ public:
 	// Functions for input file parsing and initialize
 	void assign_cluster(std::string input);
 	void read_from_file(std::string file_dir);
+	int jz_modulus(const HParam& hparam);
+	void make_jz_blocks();
+	void make_sym_blocks(const HParam& hparam);
+	void unfold_sym_blocks();
+	void mirror_sz_blocks();
+	void trim_spin_target();
+	double min_eigval();
+	void index_eigval();
+	size_t level_count();
+	std::vector<bindex> level_states(size_t u);
+	std::vector<bindex> eig_near(double en, double tol = TOL);
+	int op_irrep(const std::function<dcomp(ulli,ulli)>& amp);
+	bool dipole_allowed(Hilbert& EX, const bindex& g, const bindex& e, int irrep);
 
 	// Nice Collection of Hash Functions
 	bindex Hash(ulli s) {return (this->*hashfunc)(s);};
@@ -60,6 +85,46 @@ public:
 	bindex k_Hash(ulli s);
 	ulli k_Hashback(bindex ind);
 
+private:
+	// Rank tables for Jz blocks, a state is split into its spin down half (a) and spin up half (b)
+	// index in block = offset of a (Block::rank) + index of b among halves of the same class
+	int jz_cmin = 0, jz_ncls = 0;
+	std::vector<int> jz_orb;						// 2Jz of a spin down hole in each orbital
+	std::vector<size_t> jz_koff;					// rank offset of halves with k holes
+	std::vector<size_t> jz_upind;					// index of spin up half within its class
+	std::vector<long> jz_blkind;					// block index of each 2Jz class
+	std::vector<std::vector<ulli>> jz_upclass;		// spin up halves of each class
+	std::vector<std::vector<std::pair<ulli,ulli>>> jz_dnlist; // (offset, a) of each block
+	int jz_cls(int jz2) {return jz_mod ? ((jz2 % jz_mod) + jz_mod) % jz_mod : jz2;};
+	int jz_half(ulli x, bool up);
+	size_t half_rank(ulli x);
+	size_t jz_upkey(int k, int nc, int c);
+
+	// Symmetry adapted blocks from translations of the sites and point group operations that map
+	// each orbital to one orbital (D2h subgroup of D4h/Oh). Each block holds one (Sz, class) sector,
+	// in a real basis of cos/sin combinations of the orbit if k != -k. Hash still gives the
+	// plain (Sz) index, fill_hblk folds the matrix elements into the blocks
+	std::vector<Block<double>> plain_blks;			// Sz/normal blocks, restored after unfolding
+	std::vector<int> sym_gens;						// point group generators that commute with H
+	std::vector<std::vector<int>> sym_perm;			// orbital permutation of each group element
+	std::vector<ulli> sym_neg;						// orbitals that change sign under each element
+	std::vector<std::vector<int>> sym_trans;		// translation vector of each element
+	std::vector<int> sym_pg;						// point group element, bits of sym_gens
+	std::vector<std::vector<int>> sym_mom;			// momentum of each class (with -k)
+	std::vector<int> sym_irr;						// point group irrep of each class
+	std::vector<bool> sym_selfconj;					// k = -k
+	std::vector<std::vector<ulli>> sym_reps;		// sorted representatives of each sector
+	std::vector<std::vector<int>> sym_stab;			// stabilizer size of each representative
+	std::vector<std::vector<std::vector<long>>> sym_bind; // (sector, class, rep) -> index in block
+	std::vector<std::vector<long>> sym_blk;			// (sector, class) -> block index
+	std::vector<Block<double>>& plain_blocks() {return SYM_BLOCK ? plain_blks : hblks;};
+	int sym_sector(ulli s);
+	double sym_phase(int c, int j);
+	std::pair<ulli,double> sym_op(ulli s, int j);
+	ulli sym_orbit(ulli s, int& j, double& sign);
+	bool pg_generator(int gen, const vecd& hybmat, std::vector<int>& perm, ulli& neg);
+	void fill_symblk(double matelem, ulli lhs, ulli rhs);
+
 	// Need to fix these
 	// Maybe a copy constructor?????
 	// std::vector<double> momentum(double* eigvec, bool return_square = true);
@@ -6,6 +6,9 @@
 #include <fstream>
 #include "multiplet.hpp"
 #include "photon.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #ifdef WINDOWS
     #include <direct.h>
@@ -179,6 +182,16 @@ void read_input(string IDIR, PM& pm, HParam& hparam, bool& overwrite) {
 							else if (p == "SIGPI") skip = read_num(line.substr(s+1,line.size()-1),&hparam.sig_pi,1,p=p);
 							else if (p == "EFFDEL") skip = read_bool(line.substr(s+1,line.size()-1),hparam.effective_delta);
 							else if (p == "BLOCK") skip = read_bool(line.substr(s+1,line.size()-1),hparam.block_diag);
+							else if (p == "KBLOCK") skip = read_bool(line.substr(s+1,line.size()-1),hparam.k_block);
+							else if (p == "PGBLOCK") skip = read_bool(line.substr(s+1,line.size()-1),hparam.pg_block);
+							else if (p == "PARDIAG") skip = read_bool(line.substr(s+1,line.size()-1),hparam.par_diag);
+							else if (p == "DIAGRANGE") skip = read_bool(line.substr(s+1,line.size()-1),hparam.diag_range);
+							else if (p == "WARMSTART") skip = read_bool(line.substr(s+1,line.size()-1),hparam.warm_start);
+							else if (p == "EIGTRUNC") skip = read_num(line.substr(s+1,line.size()-1),&hparam.eig_trunc,1,p=p);
+							else if (p == "EIGFLOAT") skip = read_bool(line.substr(s+1,line.size()-1),hparam.eig_float);
+							else if (p == "SZFLIP") skip = read_bool(line.substr(s+1,line.size()-1),hparam.sz_flip);
+							else if (p == "STARGET") skip = read_num(line.substr(s+1,line.size()-1),&hparam.s_target,1,p=p);
+							else if (p == "SPENALTY") skip = read_num(line.substr(s+1,line.size()-1),&hparam.s_penalty,1,p=p);
 							else if (p == "GSDIAG") skip = read_num(line.substr(s+1,line.size()-1),&hparam.gs_diag_option,1,p=p);
 							else if (p == "EXDIAG") skip = read_num(line.substr(s+1,line.size()-1),&hparam.ex_diag_option,1,p=p);
 							else if (p == "SITEOCC") skip = read_bool(line.substr(s+1,line.size()-1),hparam.print_site_occ);
@@ -231,8 +244,15 @@ void read_input(string IDIR, PM& pm, HParam& hparam, bool& overwrite) {
 							// Spectroscopy solver, 1: Exact Solution, 2: Classic KH, 3: 1+2, 4 (To do): Cont FE, Biconj
 							else if (p == "SOLVER") skip = read_num(line.substr(s+1,line.size()-1),&pm.spec_solver,1,p=p);
 							else if (p == "PRECOND") skip = read_num(line.substr(s+1,line.size()-1),&pm.precond,1,p=p);
+							else if (p == "MULTISHIFT") skip = read_bool(line.substr(s+1,line.size()-1),pm.multi_shift);
+							else if (p == "MIDSOLVER") skip = read_num(line.substr(s+1,line.size()-1),&pm.mid_solver,1,p=p);
+							else if (p == "SAVECFE") skip = read_bool(line.substr(s+1,line.size()-1),pm.save_cfe);
+							else if (p == "RESPEC") skip = read_bool(line.substr(s+1,line.size()-1),pm.respec);
+							else if (p == "KPM") skip = read_num(line.substr(s+1,line.size()-1),&pm.kpm,1,p=p);
+							else if (p == "KPMKERNEL") skip = read_num(line.substr(s+1,line.size()-1),&pm.kpm_kernel,1,p=p);
 							else if (p == "EPSAB") skip = read_num(line.substr(s+1,line.size()-1),&pm.eps_ab,1,p=p);
 							else if (p == "EPSLOSS") skip = read_num(line.substr(s+1,line.size()-1),&pm.eps_loss,1,p=p);
+							else if (p == "KHWINDOW") skip = read_num(line.substr(s+1,line.size()-1),&pm.kh_window,1,p=p);
 							else if (p == "NITERCFE") skip = read_num(line.substr(s+1,line.size()-1),&pm.niterCFE,1,p=p);
 							else if (p == "CGTOL") skip = read_num(line.substr(s+1,line.size()-1),&pm.CG_tol,1,p=p);
 							else if (p == "NEDOS") skip = read_num(line.substr(s+1,line.size()-1),&pm.nedos,1,p=p);
@@ -285,11 +305,162 @@ bool if_photon_file_exist(const string edge, const string work_dir, bool is_XAS,
 	return pfile.good();
 }
 
+void read_guess(Hilbert& hilbs, const string& fname) {
+	// Eigenvectors of a previous run as starting vectors, blocks whose size changed are skipped
+	ifstream gfile(fname,ios::binary);
+	if (!gfile.good()) return;
+	size_t nblk = 0, used = 0;
+	gfile.read((char*)&nblk,sizeof(size_t));
+	for (size_t b = 0; b < nblk && gfile.good(); ++b) {
+		size_t size = 0, nev = 0;
+		gfile.read((char*)&size,sizeof(size_t));
+		gfile.read((char*)&nev,sizeof(size_t));
+		vector<double> vec(size*nev);
+		gfile.read((char*)vec.data(),size*nev*sizeof(double));
+		if (b < hilbs.hblks.size() && hilbs.hblks[b].size == size && gfile.good()) {
+			hilbs.hblks[b].guess = move(vec);
+			used++;
+		}
+	}
+	cout << "Read starting vectors from " << fname << " for " << used << " blocks" << endl;
+	return;
+}
+
+void write_guess(Hilbert& hilbs, const string& fname) {
+	ofstream gfile(fname,ios::binary);
+	size_t nblk = hilbs.hblks.size();
+	gfile.write((char*)&nblk,sizeof(size_t));
+	for (auto& blk : hilbs.hblks) {
+		// Only iterative solvers use starting vectors
+		size_t nev = (blk.eigvec && blk.diag_option >= 4) ? blk.nev : 0;
+		gfile.write((char*)&blk.size,sizeof(size_t));
+		gfile.write((char*)&nev,sizeof(size_t));
+		if (nev) gfile.write((char*)blk.eigvec.get(),blk.size*nev*sizeof(double));
+	}
+	return;
+}
+
+void gather_blocks(Hilbert& hilbs) {
+	// Eigenpairs of blocks diagonalized on other ranks are sent to rank 0, in block order
+	int rank = ed::mpi_rank();
+	for (auto& blk : hilbs.hblks) {
+		if (!blk.owner || (rank && blk.owner != rank)) continue;
+		size_t head[2] = {blk.nev, size_t(blk.diag_option)};
+		if (rank) {
+			ed::mpi_send(head,sizeof(head),0);
+			ed::mpi_send(blk.eig.get(),blk.nev*sizeof(double),0);
+			ed::mpi_send(blk.eigvec.get(),blk.nev*blk.size*sizeof(double),0);
+			blk.eig.reset();
+			blk.eigvec.reset();
+			continue;
+		}
+		ed::mpi_recv(head,sizeof(head),blk.owner);
+		blk.nev = head[0];
+		blk.diag_option = head[1];
+		blk.eig = uptrd(new double[blk.nev]);
+		blk.eigvec = uptrd(new double[blk.nev*blk.size]);
+		ed::mpi_recv(blk.eig.get(),blk.nev*sizeof(double),blk.owner);
+		ed::mpi_recv(blk.eigvec.get(),blk.nev*blk.size*sizeof(double),blk.owner);
+	}
+	return;
+}
+
+void diagonalize_blocks(Hilbert& hilbs, size_t nev, bool clear_mat, bool concurrent, 
+						char range = 'A', double vl = 0, double vu = 0, string guess_file = "") {
+	// Diagonalize every assembled block. If concurrent, dense blocks run at the same time, largest
+	// first, each with a share of the threads proportional to its cost. Iterative solvers (ARPACK
+	// keeps internal state between calls) always run one at a time with all threads
+	// range is passed to DSYEVR blocks, 'I': lowest nev eigenpairs, 'V': eigenvalues in (vl,vu]
+	// If guess_file is set, iterative solvers start from the eigenvectors stored there, which
+	// are overwritten with the new ones
+	// Blocks spread over MPI ranks are only diagonalized by their owner and gathered on rank 0,
+	// other ranks return without eigenpairs
+	if (!guess_file.empty()) read_guess(hilbs,guess_file);
+	vector<size_t> dense, sparse;
+	for (size_t b = 0; b < hilbs.hblks.size(); ++b) {
+		if (!hilbs.sz_active(hilbs.hblks[b].get_sz()) || !hilbs.blk_local(b)) continue;
+		hilbs.hblks[b].warm_start = !guess_file.empty();
+		hilbs.hblks[b].range = range;
+		hilbs.hblks[b].vl = vl;
+		hilbs.hblks[b].vu = vu;
+		if (concurrent && hilbs.hblks[b].diag_option < 4) dense.push_back(b);
+		else sparse.push_back(b);
+	}
+	auto diag_blk = [&](size_t b, int nthreads) {
+		#pragma omp critical
+		{
+			cout << "Diagonalizing block number: " << b << ", matrix size: " << hilbs.hblks[b].size;
+			if (nthreads) cout << ", threads: " << nthreads;
+			cout << endl;
+		}
+		auto start = chrono::high_resolution_clock::now();
+		hilbs.hblks[b].diagonalize(nev,clear_mat);
+		auto stop = chrono::high_resolution_clock::now();
+		auto duration = chrono::duration_cast<chrono::milliseconds>(stop - start);
+		#pragma omp critical
+		{
+			if (nthreads) cout << "Block number: " << b << ", ";
+			cout << "Run time = " << duration.count() << " ms\n" << endl;
+		}
+	};
+	if (!dense.empty()) {
+		auto cost = [&](size_t b) {return pow(double(hilbs.hblks[b].size),3);};
+		sort(dense.begin(),dense.end(),[&](size_t x, size_t y){return cost(x) > cost(y);});
+		double total = 0;
+		for (auto& b : dense) total += cost(b);
+#ifdef _OPENMP
+		int nthreads = omp_get_max_threads(), levels = omp_get_max_active_levels();
+		omp_set_max_active_levels(2);
+		#pragma omp parallel for schedule(dynamic,1) num_threads(min(int(dense.size()),nthreads))
+		for (size_t i = 0; i < dense.size(); ++i) {
+			int nt = max(1,int(nthreads*cost(dense[i])/total));
+			omp_set_num_threads(nt);
+			diag_blk(dense[i],nt);
+		}
+		omp_set_max_active_levels(levels);
+#else
+		for (auto& b : dense) diag_blk(b,0);
+#endif
+	}
+	for (auto& b : sparse) diag_blk(b,0);
+	if (hilbs.mpi_ranks) {
+		gather_blocks(hilbs);
+		if (ed::mpi_rank()) return;
+	}
+	if (!guess_file.empty() && !ed::mpi_rank()) write_guess(hilbs,guess_file);
+	hilbs.trim_spin_target();
+	hilbs.unfold_sym_blocks();
+	hilbs.mirror_sz_blocks();
+	hilbs.index_eigval();
+	return;
+}
+
+void compress_eigvec(Hilbert& hilbs, const HParam& hparam) {
+	// Truncated and/or single precision eigenvector store, spectra only visit kept coefficients
+	if (hparam.eig_trunc <= 0 && !hparam.eig_float) return;
+	double before = 0, after = 0, discard = 0, round = 0;
+	for (auto& blk : hilbs.hblks) {
+		if (!blk.eigvec) continue;
+		double d, r;
+		before += blk.store_bytes();
+		blk.compress(hparam.eig_trunc,hparam.eig_float,d,r);
+		after += blk.store_bytes();
+		discard = max(discard,d);
+		round = max(round,r);
+	}
+	auto flags = cout.flags();
+	cout << "Eigenvector storage: " << before/1e6 << " MB -> " << after/1e6 << " MB, largest dropped weight: " 
+		 << scientific << discard << ", largest rounding error: " << round << endl;
+	cout.flags(flags);
+	return;
+}
+
 double calculate_effective_delta(const string& input_dir, HParam& hparam, const PM& pm) {
 	// Measures the energy difference between dn/dn+1 if Delta is set to 0
 	double inp_tpd = hparam.tpd, inp_tpp = hparam.tpp, mlct = hparam.MLdelta;
-	int diag_option = hparam.gs_diag_option;
-	hparam.gs_diag_option = 4;
+	int diag_option = hparam.gs_diag_option, gs_nev = hparam.gs_nev;
+	hparam.gs_diag_option = 0;
+	hparam.gs_nev = 100;
 	hparam.tpd = 0;
 	hparam.tpp = 0;
 	Hilbert GS(input_dir,hparam,pm.edge,false);
@@ -303,13 +474,12 @@ double calculate_effective_delta(const string& input_dir, HParam& hparam, const
 	// Redo delta here, should not need to reset the values
 	calc_ham(GS,hparam);
 	// for (size_t g = 0; g < (GS.hblks.size()+1)/2; g++) {
-	for (size_t g = 0; g < GS.hblks.size(); g++) {
-		GS.hblks[g].diagonalize(100);
-	}
+	diagonalize_blocks(GS,100,true,hparam.par_diag);
 	hparam.tpd = inp_tpd;
 	hparam.tpp = inp_tpp;
 	hparam.MLdelta = mlct;
 	hparam.gs_diag_option = diag_option;
+	hparam.gs_nev = gs_nev;
 	return effective_delta(GS,2) - U_guess;
 }
 
@@ -319,23 +489,16 @@ void dos_eigenenergy(Hilbert& hilbs, int num_eig, string dos_fname = "", string
 	multistream eig_out(false,eig_fname,"w"); 
 	dos_out.set_mode("a");
 	eig_out.set_mode("a");
-	auto all_eig = hilbs.get_all_eigval(true);
-	auto unique_eig = ed::printDistinct(all_eig,0.0,all_eig.size(),false);
-	double gs_en = unique_eig[0];
-	for (int u = 0; u < unique_eig.size(); u++) {
-		vector<bindex> eigind;
-		for (auto & hblks : hilbs.hblks) {
-			for (size_t i = 0; i < hblks.nev; ++i) {
-				if (abs(hblks.eig[i]-unique_eig[u]) < TOL) {
-					eigind.push_back(bindex(&hblks-&hilbs.hblks[0],i));
-				}
-			}
-		}
-		dos_out << unique_eig[u] << " " << eigind.size() << endl;
+	size_t nlevel = hilbs.level_count();
+	double gs_en = hilbs.level_en[0];
+	for (int u = 0; u < nlevel; u++) {
+		vector<bindex> eigind = hilbs.level_states(u);
+		dos_out << hilbs.level_en[u] << " " << eigind.size() << endl;
 		if (u < num_eig) {
 			eig_out << "Eigen-energy number: " << u+1;
-			eig_out << ", energy (rel to gs): " << unique_eig[u] - gs_en << endl; 
-			eig_out << "Spin: " << abs(hilbs.hblks[eigind[0].first].get_sz()); 
+			eig_out << ", energy (rel to gs): " << hilbs.level_en[u] - gs_en << endl; 
+			if (hilbs.JZ_BLOCK) eig_out << "Jz: " << hilbs.hblks[eigind[0].first].get_jz();
+			else eig_out << "Spin: " << abs(hilbs.hblks[eigind[0].first].get_sz()); 
 			eig_out << ", degeneracy: " << eigind.size() << endl;
 			eig_out << "------------------------------" << endl; 
 			occupation(hilbs,eigind,false,eig_fname,false);
@@ -350,6 +513,10 @@ void process_hilbert_space(Hilbert& GS, Hilbert& EX, HParam& hparam, PM& pm) {
 	double beta = 0;
 	// Assemble GS Hamiltonian
 	cout << "Assembling GS Hamiltonian..." << endl;
+	if (!hparam.gs_nev) {
+		if (pm.RIXS) hparam.gs_nev = 400;
+		else hparam.gs_nev = 10 * GS.tot_site_num();
+	}
 	auto start = chrono::high_resolution_clock::now();
 	calc_ham(GS,hparam);
 	auto stop = chrono::high_resolution_clock::now();
@@ -359,45 +526,37 @@ void process_hilbert_space(Hilbert& GS, Hilbert& EX, HParam& hparam, PM& pm) {
 	cout << "Diagonalizing Hamiltonian..." << endl;
 	auto diag_start = chrono::high_resolution_clock::now();
 	cout << "Diagonalizing Ground State" << endl;
-	if (!hparam.gs_nev) {
-		if (pm.RIXS) hparam.gs_nev = 400;
-		else hparam.gs_nev = 10 * GS.tot_site_num();
-	}
 
 	bool clear_mat = !(pm.spec_solver == 4);
-	for (size_t g = 0; g < GS.hblks.size(); g++) {
-		start = chrono::high_resolution_clock::now();
-		cout << "Diagonalizing block number: " << g << ", matrix size: " << GS.hblks[g].size << endl;
-		GS.hblks[g].diagonalize(hparam.gs_nev,clear_mat);
-		stop = chrono::high_resolution_clock::now();
-		duration = chrono::duration_cast<chrono::milliseconds>(stop - start);
-		cout << "Run time = " << duration.count() << " ms\n" << endl;
-	}
+	diagonalize_blocks(GS,hparam.gs_nev,clear_mat,hparam.par_diag,hparam.diag_range ? 'I' : 'A',0,0,
+						hparam.warm_start ? "gs_guess.bin" : "");
 	auto diag_stop = chrono::high_resolution_clock::now();
 	auto diag_duration = chrono::duration_cast<chrono::milliseconds>(diag_stop - diag_start);
 
-	double gs_en = GS.hblks[0].eig[0];
-	vector<bindex> gsi;
-	for (auto &gsb : GS.hblks) for (size_t i = 0; i < gsb.nev; ++i) if (gsb.eig[i] <= gs_en) gs_en = gsb.eig[i];
-	// Calculate Partition function
-	double Z = 0, emin = -25.0, emax = 25.0, SDegen = 0;
-	for (size_t i = 0; i < GS.hblks.size(); ++i) {
-	for (size_t j = 0; j < GS.hblks[i].nev; ++j) {
-		if (abs(GS.hblks[i].eig[j]-gs_en) < TOL) {
-			Z += exp(-beta*GS.hblks[i].eig[j]);
-			if (abs(GS.hblks[i].get_sz()) >= SDegen) SDegen = abs(GS.hblks[i].get_sz());
-			gsi.push_back({i,j});
+	// With blocks spread over MPI ranks only rank 0 holds eigenpairs, the others go on to the 
+	// core-hole assembly
+	bool root = !GS.mpi_ranks || !ed::mpi_rank();
+	compress_eigvec(GS,hparam);
+	double gs_en = root ? GS.min_eigval() : 0;
+	ed::mpi_bcast(&gs_en,sizeof(double));
+	if (root) {
+		vector<bindex> gsi = GS.eig_near(gs_en);
+		// Calculate Partition function
+		double Z = 0, emin = -25.0, emax = 25.0, SDegen = 0;
+		for (auto& g : gsi) {
+			Z += exp(-beta*GS.hblks[g.first].eig[g.second]);
+			if (abs(GS.hblks[g.first].get_sz()) >= SDegen) SDegen = abs(GS.hblks[g.first].get_sz());
 		}
-	}}
-	if (GS.BLOCK_DIAG) cout << "Grounds State Spin Quantum Number (S): " << SDegen << endl;
-	cout << "Calculating Occupation (with degeneracy): " << gsi.size() << endl;
-	occupation(GS,gsi,true,"");
-	occupation(GS,gsi,true,"",true);
-	wvfnc_weight(GS,gsi,3,true);
-	// auto all_eig = GS.get_all_eigval(true);
-	// ed::printDistinct(all_eig,0.0,all_eig.size(),true);
-	dos_eigenenergy(GS,20,"dos.txt","eig.txt");
-	cout << endl;
+		if (GS.BLOCK_DIAG) cout << "Grounds State Spin Quantum Number (S): " << SDegen << endl;
+		cout << "Calculating Occupation (with degeneracy): " << gsi.size() << endl;
+		occupation(GS,gsi,true,"");
+		occupation(GS,gsi,true,"",true);
+		wvfnc_weight(GS,gsi,3,true);
+		// auto all_eig = GS.get_all_eigval(true);
+		// ed::printDistinct(all_eig,0.0,all_eig.size(),true);
+		dos_eigenenergy(GS,20,"dos.txt","eig.txt");
+		cout << endl;
+	}
 
 	// Assemble Core Hole Hamiltonian
 	cout << "Assembling Core Hole Hamiltonian..." << endl;
@@ -409,55 +568,53 @@ void process_hilbert_space(Hilbert& GS, Hilbert& EX, HParam& hparam, PM& pm) {
 		// Also use new spin orbit coupling values
 		hparam.SO[1] = hparam.SO[2];
 	}
+	if (pm.spec_solver != 4 && !hparam.ex_nev) {
+		if (pm.edge == "K") hparam.ex_nev = 200;
+		else if (pm.edge == "L3") hparam.ex_nev = 500;
+		else if (pm.edge == "L") hparam.ex_nev = 1500;
+	}
 	calc_ham(EX,hparam);
 	stop = chrono::high_resolution_clock::now();
 	duration = chrono::duration_cast<chrono::milliseconds>(stop - start);
 	cout << "Run time = " << duration.count() << " ms\n" << endl;
 	cout << "Diagonalizing Core-Hole Hamiltonian" << endl;
 	diag_start = chrono::high_resolution_clock::now();
-	if (pm.spec_solver != 4 && !hparam.ex_nev) {
-		if (pm.edge == "K") hparam.ex_nev = 200;
-		else if (pm.edge == "L3") hparam.ex_nev = 500;
-		else if (pm.edge == "L") hparam.ex_nev = 1500;
-	}
 
-	for (size_t e = 0; e < EX.hblks.size(); e++) {
-		start = chrono::high_resolution_clock::now();
-		cout << "Diagonalizing block number: " << e << ", matrix size: " << EX.hblks[e].size << endl;
-		cout << "Number of eigenvalues: " << hparam.ex_nev << endl;
+	cout << "Number of eigenvalues: " << hparam.ex_nev << endl;
+	if (hparam.ex_nev > 0) {
 		// Only need the lowest eigenvalue if using Lanczos
-		if (hparam.ex_nev > 0) {
-			if (pm.spec_solver == 4) EX.hblks[e].diagonalize(5,clear_mat);
-			else EX.hblks[e].diagonalize(hparam.ex_nev,clear_mat);
-		} else {
-			if (pm.spec_solver != 4) {
-				// This will block out anycase where EXNEV <= 0 and Lanczos
-				cout << "WARNING: EXNEV = 0" << endl;
-				exit(1);
-			} else cout << "skipping core-hole state diagonalization" << endl;
-			pm.skip_ch_diag = true;
-		}
-		stop = chrono::high_resolution_clock::now();
-		duration = chrono::duration_cast<chrono::milliseconds>(stop - start);
-		cout << "Run time = " << duration.count() << " ms\n" << endl;
+		size_t ex_nev = (pm.spec_solver == 4) ? 5 : hparam.ex_nev;
+		bool ab_window = pm.spec_solver != 4 && pm.abmax == -1 && pm.incident[2] != -1;
+		string guess_file = hparam.warm_start ? "ex_guess.bin" : "";
+		if (!hparam.diag_range && !(ab_window && hparam.ex_diag_option == 5)) 
+			diagonalize_blocks(EX,ex_nev,clear_mat,hparam.par_diag,'A',0,0,guess_file);
+		else if (ab_window) {
+			// Absorption window is fixed, only solve core-hole states inside it
+			double vl = gs_en + pm.ab_range[0], vu = gs_en + pm.ab_range[1];
+			cout << "Core-hole eigenvalues in: " << vl << ", " << vu << endl;
+			diagonalize_blocks(EX,ex_nev,clear_mat,hparam.par_diag,'V',vl,vu,guess_file);
+		} else diagonalize_blocks(EX,ex_nev,clear_mat,hparam.par_diag,'I',0,0,guess_file);
+	} else {
+		if (pm.spec_solver != 4) {
+			// This will block out anycase where EXNEV <= 0 and Lanczos
+			cout << "WARNING: EXNEV = 0" << endl;
+			exit(1);
+		} else cout << "skipping core-hole state diagonalization" << endl;
+		pm.skip_ch_diag = true;
 	}
 	diag_stop = chrono::high_resolution_clock::now();
 	diag_duration += chrono::duration_cast<chrono::milliseconds>(diag_stop - diag_start);
+	if (!pm.skip_ch_diag) compress_eigvec(EX,hparam);
 	
-	if (!pm.skip_ch_diag) {
-		double ex_min_en = EX.hblks[0].eig[0];
-		vector<bindex> exmin_ind;
-		for (auto &exb : EX.hblks) for (size_t i = 0; i < exb.nev; ++i) if (exb.eig[i] <= ex_min_en) ex_min_en = exb.eig[i];
-		SDegen = 0;
-
-		for (size_t i = 0; i < EX.hblks.size(); ++i) {
-		for (size_t j = 0; j < EX.hblks[i].nev; ++j) {
-			if (abs(EX.hblks[i].eig[j]-ex_min_en) < TOL) {
-				if (hparam.block_diag && abs(EX.hblks[i].get_sz()) >= SDegen) 
-					SDegen = abs(EX.hblks[i].get_sz());
-				exmin_ind.push_back({i,j});
-			}
-		}}
+	if (!pm.skip_ch_diag && root) {
+		double ex_min_en = EX.min_eigval();
+		vector<bindex> exmin_ind = EX.eig_near(ex_min_en);
+		double SDegen = 0;
+
+		for (auto& e : exmin_ind) {
+			if (hparam.block_diag && abs(EX.hblks[e.first].get_sz()) >= SDegen) 
+				SDegen = abs(EX.hblks[e.first].get_sz());
+		}
 		if (pm.incident[2] == -1) pm.set_incident_points(true,gs_en,ex_min_en);
 		dos_eigenenergy(EX,10,"exdos.txt","exeig.txt");
 		wvfnc_weight(EX,exmin_ind,3,true);
@@ -474,7 +631,8 @@ void process_hilbert_space(Hilbert& GS, Hilbert& EX, HParam& hparam, PM& pm) {
 			pm.ab_range[1] = pm.ab_range[0] + pm.abmax;
 			cout << "======> NEW AB range: " << pm.ab_range[0] << ", " << pm.ab_range[1] << endl;
 		} else cout << "======> OLD AB range: " << pm.ab_range[0] << ", " << pm.ab_range[1] << endl;
-	} else {
+	} else if (root) {
+		// Other ranks only took part in the diagonalization
 		if (pm.XAS && pm.abmax != -1) {
 			cerr << "Needs (parameter) AB if core-hole diagonalize is skipped" << endl;
 			exit(1);
@@ -487,6 +645,7 @@ void process_hilbert_space(Hilbert& GS, Hilbert& EX, HParam& hparam, PM& pm) {
 
 int main(int argc, char** argv){
 	signal(SIGSEGV, handler);
+	ed::mpi_init(&argc,&argv);
 	char CurrentPath[FILENAME_MAX];
 	if (!GetCurrentDir(CurrentPath, sizeof(CurrentPath))) {return errno;}
 	string work_dir(CurrentPath);
@@ -506,6 +665,15 @@ int main(int argc, char** argv){
 		if (hparam.FG[2] != 0 || hparam.FG[3] != 0) 
 			throw invalid_argument("invalid FG input");
 	} else if (pm.edge != "L" && pm.edge != "L3") throw invalid_argument("invalid edge input: " + pm.edge);
+	if ((hparam.k_block || hparam.pg_block || hparam.sz_flip) && pm.spec_solver == 4) {
+		// Lanczos spectra act with the core-hole Hamiltonian of every block in the plain basis
+		cout << "WARNING: KBLOCK/PGBLOCK/SZFLIP are not supported with SOLVER = 4, turning them off" << endl;
+		hparam.k_block = hparam.pg_block = hparam.sz_flip = false;
+	}
+	if (pm.kpm && (pm.save_cfe || pm.respec)) {
+		cout << "WARNING: SAVECFE/RESPEC use continued fraction coefficients, turning off KPM" << endl;
+		pm.kpm = 0;
+	}
 	// U = F^0 + 4*F^2 + 36*F^4
 	// Scaling Slater Parameters, without the bare Coulomb term
 	for (int i = 1; i < 3; ++i) hparam.SC[0][i] *= hparam.HFscale;
@@ -515,6 +683,14 @@ int main(int argc, char** argv){
 
 	Hilbert GS(IDIR,hparam,pm.edge.substr(0,1),false);
 	Hilbert EX(IDIR,hparam,pm.edge.substr(0,1),true);
+	if (ed::mpi_size() > 1 && pm.spec_solver == 4) {
+		// Lanczos spectra act with the Hamiltonians, every rank keeps a share of the rows of each block
+		GS.mpi_rows = EX.mpi_rows = true;
+		cout << "MPI ranks: " << ed::mpi_size() << ", rows of every block are spread over all ranks" << endl;
+	} else if (ed::mpi_size() > 1) {
+		GS.mpi_ranks = EX.mpi_ranks = ed::mpi_size();
+		cout << "MPI ranks: " << ed::mpi_size() << ", blocks are spread over all ranks" << endl;
+	}
 
 	cout << "Input parameters" << endl;
 	cout << "TM 2p Spin-Orbit Coupling: " << hparam.SO[0] << " eV" << endl;
@@ -598,7 +774,13 @@ int main(int argc, char** argv){
 		cout << "absorption broadening: " << pm.eps_ab << endl;
 		cout << "loss broadening: " << pm.eps_loss << endl;
 		cout << "conjugate gradient tolerance: " << pm.CG_tol << endl;
-		cout << "CFE iterations: " << pm.niterCFE << endl;
+		if (pm.multi_shift) {
+			cout << "intermediate state solver: shifted COCG" << endl;
+			if (pm.mid_solver || pm.precond) cout << "WARNING: MIDSOLVER/PRECOND are not used with MULTISHIFT" << endl;
+		} else cout << "intermediate state solver: " << (pm.mid_solver == 1 ? "COCG" : pm.mid_solver == 2 ? "COCR" : "BiCGS") << endl;
+		if (pm.kpm) cout << "KPM moments: " << pm.kpm << ", kernel: " << (pm.kpm_kernel == 1 ? "Lorentz" : "Jackson") << endl;
+		else cout << "CFE iterations: " << pm.niterCFE << endl;
+		if (pm.save_cfe) cout << "Lanczos coefficients are saved to *.cfe" << endl;
 	}
 	else if (pm.RIXS) {
 		if (pm.eloss) cout << "	Using energy loss" << endl;
@@ -634,9 +816,20 @@ int main(int argc, char** argv){
 	auto duration = chrono::duration_cast<chrono::milliseconds>(stop - start);
 	cout << "Number of Holes: " << GS.num_vh << endl;
 	cout << "Run time = " << duration.count() << " ms\n" << endl;
-	process_hilbert_space(GS,EX,hparam,pm);
+	if (pm.respec) {
+		// Spectra are rebuilt from the saved Lanczos coefficients, existing spectra are replaced
+		cout << "Rebuilding spectra from saved Lanczos coefficients" << endl;
+		if (pm.abmax != -1) throw invalid_argument("RESPEC needs AB instead of ABMAX");
+		overwrite = true;
+	} else process_hilbert_space(GS,EX,hparam,pm);
+	if ((GS.mpi_ranks || pm.respec) && ed::mpi_rank()) {
+		// Spectra are computed on rank 0
+		ed::mpi_finalize();
+		return 0;
+	}
 	// Calculate Cross Sections
 	vector<double> pvin = pm.pvin, pvout = pm.pvout;
+	DipoleCache dcache; // Dipole operators are shared by all polarizations
 
 
 	if (pm.XAS) {
@@ -648,16 +841,19 @@ int main(int argc, char** argv){
 			for (auto e : pm.pvin) cout << (int)e << " ";
 			cout << endl;
 			if (if_photon_file_exist(pm.edge,work_dir,true,overwrite,pm.pvin) && !overwrite) continue;
-			XAS(GS,EX,pm);
+			if (pm.respec) XAS_from_cfe(pm);
+			else XAS(GS,EX,pm,&dcache);
 		}
 	}
 	if (pm.RIXS) {
-		if (pm.inc_e_points.size() != 0) {
+		if (pm.respec) cout << "RIXS Energy points from the saved run";
+		else if (pm.inc_e_points.size() != 0) {
 			cout << "RIXS Energy points: ";
 			for (auto &inc_e : pm.inc_e_points) cout << inc_e << ", ";
 		} else {
 			cout << "No RIXS energy points, check your input" << endl;
 			cout << "* If EXNEV = 0, then the -1 option on the 3rd argument is no longer available" << endl;
+			ed::mpi_finalize();
 			return 0;
 		}
 		cout << endl;
@@ -679,7 +875,8 @@ int main(int argc, char** argv){
 					continue;
 				}
 				if (if_photon_file_exist(pm.edge,work_dir,false,overwrite,pm.pvin,pm.pvout) && !overwrite) continue;
-				RIXS(GS,EX,pm);
+				if (pm.respec) RIXS_from_cfe(pm);
+				else RIXS(GS,EX,pm,&dcache);
 			}
 		}
 	}
@@ -687,5 +884,6 @@ int main(int argc, char** argv){
 	auto run_stop = chrono::high_resolution_clock::now();
 	cout << endl << "Total elapsed time: " << endl;
 	cout << ed::format_duration(chrono::duration_cast<chrono::milliseconds>(run_stop-run_start)) << endl;
+	ed::mpi_finalize();
 	return 0;
 }
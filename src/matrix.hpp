@@ -18,17 +18,39 @@ inline void _symv(char* UPLO, int* N, double* alpha, double* A, int* LDA, double
 	dsymv(UPLO,N,alpha,A,LDA,x,incx,beta,y,incy);
 	return;
 }
+inline void _symm(char* SIDE, char* UPLO, int* M, int* N, double* alpha, double* A, int* LDA, 
+		double* B, int* LDB, double* beta, double* C, int* LDC) {
+	dsymm(SIDE,UPLO,M,N,alpha,A,LDA,B,LDB,beta,C,LDC);
+	return;
+}
+inline void _gemm(char* TA, char* TB, int* M, int* N, int* K, double* alpha, double* A, int* LDA, 
+		double* B, int* LDB, double* beta, double* C, int* LDC) {
+	dgemm(TA,TB,M,N,K,alpha,A,LDA,B,LDB,beta,C,LDC);
+	return;
+}
 #else
 #define lpk_int int
 extern "C" {
 	extern void dsymv_(char*,int*,double*,double*,int*,double*,int*,
 						double*,double*,int*);
+	extern void dsymm_(char*,char*,int*,int*,double*,double*,int*,double*,int*,
+						double*,double*,int*);
+	extern void dgemm_(char*,char*,int*,int*,int*,double*,double*,int*,double*,int*,
+						double*,double*,int*);
 }
 
 inline void _symv(char* UPLO, int* N, double* alpha, double* A, int* LDA, double* x, 
 		int* incx, double* beta, double* y, int* incy) {
 	dsymv_(UPLO,N,alpha,A,LDA,x,incx,beta,y,incy);
 }
+inline void _symm(char* SIDE, char* UPLO, int* M, int* N, double* alpha, double* A, int* LDA, 
+		double* B, int* LDB, double* beta, double* C, int* LDC) {
+	dsymm_(SIDE,UPLO,M,N,alpha,A,LDA,B,LDB,beta,C,LDC);
+}
+inline void _gemm(char* TA, char* TB, int* M, int* N, int* K, double* alpha, double* A, int* LDA, 
+		double* B, int* LDB, double* beta, double* C, int* LDC) {
+	dgemm_(TA,TB,M,N,K,alpha,A,LDA,B,LDB,beta,C,LDC);
+}
 #endif
 
 template<typename T> 
@@ -48,12 +70,27 @@ public:
 	virtual T* get_dense() = 0; // Call this carefully
 	virtual void reset_ham(T** arr) {return;};
 	virtual void mvmult(T* vec_in, T* vec_out, int N) = 0;
+	virtual void mmult(T* vec_in, T* vec_out, int N, int nvec) {
+		// Multiple vectors, stored one after another
+		for (int k = 0; k < nvec; ++k) mvmult(vec_in+size_t(k)*N,vec_out+size_t(k)*N,N);
+	};
+	virtual void get_diag(T* diag) = 0;
 	virtual void mvmult_cmplx(const vecc& vec_in, vecc& vec_out) = 0; // Unfortunate implementation
 	virtual void clear_mat() = 0;
 	virtual void is_symmetric() = 0; // Only Support Dense Matrices
 	virtual int get_mat_size() = 0;
 	// Diagonal preconditioner with (z-H_diag)^(-1)
 	virtual vecc precond(const vecc& vec_in, dcomp shift) = 0;
+	// Row partitioned matrices act on the local part of vectors, sums over that part are completed
+	// with allreduce, scatter/gather convert between full and local vectors
+	virtual void allreduce(double* x, int n) {return;};
+	virtual void allreduce(dcomp* x, int n) {return;};
+	virtual vecc scatter(const vecc& vec) {return vec;};
+	virtual vecc gather(const vecc& vec) {return vec;};
+	virtual void gather(const T* vec_in, T* vec_out, int nvec) {
+		std::copy(vec_in,vec_in+size_t(this->size)*nvec,vec_out);
+	};
+	virtual int get_full_dim() {return this->size;};
 	int get_mat_dim() {return this->size;};
 protected:
 	int size = 0;
@@ -89,6 +126,18 @@ public:
 		this->ham = return_uptr<T>(&_ham);
 		return;
 	};
+	void mmult(T* vec_in, T* vec_out, int n, int nvec) {
+		T* _ham = this->get_dense();
+		lpk_int N = n, M = nvec, lda = N;
+		T alpha = 1, beta = 0;
+		char SIDE = 'L', UPLO = 'U';
+		_symm(&SIDE,&UPLO,&N,&M,&alpha,_ham,&lda,vec_in,&lda,&beta,vec_out,&lda);
+		this->ham = return_uptr<T>(&_ham);
+		return;
+	};
+	void get_diag(T* diag) {
+		for (int i = 0; i < this->size; ++i) diag[i] = ham[i*this->size+i];
+	};
 	void mvmult_cmplx(const vecc& vec_in, vecc& vec_out) {
         // specific case for complex vectors
         #pragma omp parallel for //collapse(2)
@@ -162,6 +211,30 @@ public:
 		this->sparse_mvmult(vec_in,vec_out);
 		return;
 	};
+	void mmult(T* vec_in, T* vec_out, int N, int nvec) {
+		// One pass over the nonzeros for all vectors, interleaved so each element updates a contiguous row
+		std::vector<T> in_t(size_t(N)*nvec), out_t(size_t(N)*nvec,0);
+		#pragma omp parallel for
+		for (int i = 0; i < N; ++i) 
+			for (int k = 0; k < nvec; ++k) in_t[size_t(i)*nvec+k] = vec_in[size_t(k)*N+i];
+		#pragma omp parallel for default(shared)
+		for (size_t e = 0; e < val.size(); ++e) {
+			for (int k = 0; k < nvec; ++k) {
+				atomic_add(out_t[indexj[e]*nvec+k],val[e] * in_t[indexi[e]*nvec+k]);
+				if (this->mat_type == "S" && indexj[e] != indexi[e])
+					atomic_add(out_t[indexi[e]*nvec+k],val[e] * in_t[indexj[e]*nvec+k]);
+			}
+		}
+		#pragma omp parallel for
+		for (int i = 0; i < N; ++i) 
+			for (int k = 0; k < nvec; ++k) vec_out[size_t(k)*N+i] = out_t[size_t(i)*nvec+k];
+		return;
+	};
+	void get_diag(T* diag) {
+		std::fill(diag,diag+this->size,0);
+		for (size_t e = 0; e < val.size(); ++e) 
+			if (indexi[e] == indexj[e]) diag[indexi[e]] += val[e];
+	};
 	void mvmult_cmplx(const vecc& vec_in, vecc& vec_out) {
 		if (vec_in.size() != this->size or vec_out.size() != this->size) 
 			std::cout << "MVMULT_CMPLX matrix size mismatch!" << std::endl;
@@ -234,5 +307,175 @@ private:
 	}           
 };
 
+template <typename T> 
+class DistSparse : public Matrix<T> {
+// Rows are split evenly over MPI ranks, each rank stores its rows in CSR form and vectors are 
+// local slices. Entries of other ranks needed by the local rows are fetched by halo exchange
+public:
+	DistSparse() {this->mat_type = "R";};
+	void fill_mat(int lind, int rind, T elem) {
+		if (lind < r0 || lind >= r1) return;
+		indexi.emplace_back(lind-r0);
+		indexj.emplace_back(rind);
+		val.emplace_back(elem);
+		return;
+	};
+	void malloc(int size) {
+		full = size;
+		int nrank = ed::mpi_size(), rank = ed::mpi_rank();
+		bounds = std::vector<int>(nrank+1);
+		for (int p = 0; p <= nrank; ++p) bounds[p] = (long(size)*p)/nrank;
+		r0 = bounds[rank];
+		r1 = bounds[rank+1];
+		this->size = r1-r0;
+		indexi.reserve(100*this->size);
+		indexj.reserve(100*this->size);
+		val.reserve(100*this->size);
+		return;
+	};
+	T* get_dense() {throw std::runtime_error("row partitioned matrix can't be made dense");};
+	void mvmult(T* vec_in, T* vec_out, int N) {
+		dist_mvmult(vec_in,vec_out);
+		return;
+	};
+	void get_diag(T* diag) {
+		setup();
+		std::fill(diag,diag+this->size,0);
+		for (int i = 0; i < this->size; ++i)
+			for (size_t e = rowptr[i]; e < rowptr[i+1]; ++e) if (indexj[e] == i) diag[i] += val[e];
+	};
+	void mvmult_cmplx(const vecc& vec_in, vecc& vec_out) {
+		dist_mvmult(vec_in.data(),vec_out.data());
+		return;
+	};
+	void clear_mat() {
+		indexi = std::vector<size_t>();
+		indexj = std::vector<size_t>();
+		val = std::vector<T>();
+		rowptr = std::vector<size_t>();
+		ready = false;
+		return;
+	};
+	void is_symmetric() {
+		std::cout << "Can't check symmetric matrix now" << std::endl;
+	}
+	vecc precond(const vecc& vec_in, dcomp shift) {
+		return vecc(vec_in);
+	}
+	int get_mat_size() {return val.size();};
+	int get_full_dim() {return full;};
+	void allreduce(double* x, int n) {
+#ifdef MPI_VERSION
+		MPI_Allreduce(MPI_IN_PLACE,x,n,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+#endif
+		return;
+	};
+	void allreduce(dcomp* x, int n) {allreduce((double*)x,2*n);};
+	vecc scatter(const vecc& vec) {return vecc(vec.begin()+r0,vec.begin()+r1);};
+	vecc gather(const vecc& vec) {
+		vecc out(full);
+		allgather((const double*)vec.data(),(double*)out.data(),2);
+		return out;
+	};
+	void gather(const T* vec_in, T* vec_out, int nvec) {
+		for (int k = 0; k < nvec; ++k) 
+			allgather(vec_in+size_t(k)*this->size,vec_out+size_t(k)*full,1);
+	};
+private:
+	int full = 0, r0 = 0, r1 = 0;
+	bool ready = false;
+	std::vector<int> bounds; // First row of every rank
+	std::vector<size_t> indexi, indexj, rowptr;
+	std::vector<T> val;
+	// Halo exchange: local rows sent to every rank, and number of entries received from each
+	std::vector<size_t> sidx;
+	std::vector<int> scnt, sdsp, rcnt, rdsp;
+	int nghost = 0;
+	void allgather(const double* in, double* out, int w) {
+		// w doubles per vector entry
+#ifdef MPI_VERSION
+		int nrank = bounds.size()-1;
+		std::vector<int> cnt(nrank), dsp(nrank);
+		for (int p = 0; p < nrank; ++p) {
+			cnt[p] = w*(bounds[p+1]-bounds[p]);
+			dsp[p] = w*bounds[p];
+		}
+		MPI_Allgatherv(in,w*this->size,MPI_DOUBLE,out,cnt.data(),dsp.data(),MPI_DOUBLE,MPI_COMM_WORLD);
+#else
+		std::copy(in,in+size_t(w)*this->size,out);
+#endif
+		return;
+	};
+	void setup() {
+		// Sort entries by row and number the columns of other ranks after the local ones
+		if (ready) return;
+		ready = true;
+		int nrank = bounds.size()-1;
+		std::vector<size_t> ghost;
+		for (auto j : indexj) if (j < size_t(r0) || j >= size_t(r1)) ghost.push_back(j);
+		std::sort(ghost.begin(),ghost.end());
+		ghost.erase(std::unique(ghost.begin(),ghost.end()),ghost.end());
+		nghost = ghost.size();
+		rowptr = std::vector<size_t>(this->size+1,0);
+		for (auto i : indexi) rowptr[i+1]++;
+		for (int i = 0; i < this->size; ++i) rowptr[i+1] += rowptr[i];
+		std::vector<size_t> pos(rowptr.begin(),rowptr.end()-1), col(val.size());
+		std::vector<T> v(val.size());
+		for (size_t e = 0; e < val.size(); ++e) {
+			size_t j = indexj[e], p = pos[indexi[e]]++;
+			if (j >= size_t(r0) && j < size_t(r1)) col[p] = j-r0;
+			else col[p] = this->size + (std::lower_bound(ghost.begin(),ghost.end(),j)-ghost.begin());
+			v[p] = val[e];
+		}
+		indexi = std::vector<size_t>();
+		indexj.swap(col);
+		val.swap(v);
+		rcnt = std::vector<int>(nrank,0);
+		rdsp = std::vector<int>(nrank,0);
+		scnt = std::vector<int>(nrank,0);
+		sdsp = std::vector<int>(nrank,0);
+		for (auto g : ghost) rcnt[std::upper_bound(bounds.begin(),bounds.end(),int(g))-bounds.begin()-1]++;
+		for (int p = 1; p < nrank; ++p) rdsp[p] = rdsp[p-1]+rcnt[p-1];
+#ifdef MPI_VERSION
+		// Tell every rank which of its rows are needed here
+		MPI_Alltoall(rcnt.data(),1,MPI_INT,scnt.data(),1,MPI_INT,MPI_COMM_WORLD);
+		for (int p = 1; p < nrank; ++p) sdsp[p] = sdsp[p-1]+scnt[p-1];
+		std::vector<unsigned long long> want(ghost.begin(),ghost.end()), send(sdsp[nrank-1]+scnt[nrank-1]);
+		MPI_Alltoallv(want.data(),rcnt.data(),rdsp.data(),MPI_UNSIGNED_LONG_LONG,
+					  send.data(),scnt.data(),sdsp.data(),MPI_UNSIGNED_LONG_LONG,MPI_COMM_WORLD);
+		sidx = std::vector<size_t>(send.size());
+		for (size_t i = 0; i < send.size(); ++i) sidx[i] = send[i]-r0;
+#endif
+		return;
+	};
+	template <typename U>
+	void dist_mvmult(const U* vec_in, U* vec_out) {
+		setup();
+		std::vector<U> x(size_t(this->size)+nghost);
+		std::copy(vec_in,vec_in+this->size,x.begin());
+#ifdef MPI_VERSION
+		int w = sizeof(U)/sizeof(double), nrank = bounds.size()-1;
+		std::vector<U> sbuf(sidx.size());
+		for (size_t i = 0; i < sidx.size(); ++i) sbuf[i] = vec_in[sidx[i]];
+		std::vector<int> sc(nrank), sd(nrank), rc(nrank), rd(nrank);
+		for (int p = 0; p < nrank; ++p) {
+			sc[p] = w*scnt[p];
+			sd[p] = w*sdsp[p];
+			rc[p] = w*rcnt[p];
+			rd[p] = w*rdsp[p];
+		}
+		MPI_Alltoallv(sbuf.data(),sc.data(),sd.data(),MPI_DOUBLE,
+					  x.data()+this->size,rc.data(),rd.data(),MPI_DOUBLE,MPI_COMM_WORLD);
+#endif
+		#pragma omp parallel for schedule(dynamic,256)
+		for (int i = 0; i < this->size; ++i) {
+			U sum = 0;
+			for (size_t e = rowptr[i]; e < rowptr[i+1]; ++e) sum += val[e]*x[indexj[e]];
+			vec_out[i] = sum;
+		}
+		return;
+	};
+};
+
 // A wrapper class for boost Sparse Matrix
 #endif
\ No newline at end of file
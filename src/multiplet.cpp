@@ -12,9 +12,21 @@ double calc_U(double* gaunt1, double* gaunt2, const double* SC, int size) {
 
 void calc_ham(Hilbert& hilbs, const HParam& hparam, bool nohyb) {
 	// Assemble Hamiltonian of the hilbert space
-	for (auto& blk : hilbs.hblks) {
-		if (hilbs.num_ch == 0) blk.malloc_ham(hparam.gs_diag_option);
-		if (hilbs.num_ch == 1) blk.malloc_ham(hparam.ex_diag_option);
+	// Nonzeros per row for the solver planner: one-body moves of every hole, and pair moves
+	double h = hilbs.num_vh + hilbs.num_ch, norb = hilbs.num_vorb + hilbs.num_corb;
+	double nnz_row = 1 + h*(norb-h) + h*(h-1)/2*std::min(45.0,(norb-h)*(norb-h-1)/2);
+	size_t nev = (hilbs.num_ch == 0) ? hparam.gs_nev : std::max(hparam.ex_nev,5);
+	bool full = hilbs.num_ch == 1 && hparam.ex_nev > 0; // Spectra are built from all core-hole states
+	hilbs.distribute_blocks();
+	for (size_t b = 0; b < hilbs.hblks.size(); ++b) {
+		auto& blk = hilbs.hblks[b];
+		if (!hilbs.sz_active(blk.get_sz()) || !hilbs.blk_local(b)) {
+			blk.nev = 0;
+			continue;
+		}
+		blk.mpi_rows = hilbs.mpi_rows;
+		if (hilbs.num_ch == 0) blk.malloc_ham(hparam.gs_diag_option,nev,nnz_row);
+		if (hilbs.num_ch == 1) blk.malloc_ham(hparam.ex_diag_option,nev,nnz_row,full);
 	}
 	calc_coulomb(hilbs,hparam.SC); 
 	if (hilbs.SO_on) {
@@ -24,6 +36,7 @@ void calc_ham(Hilbert& hilbs, const HParam& hparam, bool nohyb) {
 	if (hilbs.CF_on) calc_CF(hilbs,&hparam.CF[0]);
 	if (hilbs.CV_on) calc_CV(hilbs,&hparam.FG[0]);
 	if (hilbs.HYB_on) calc_HYB(hilbs,hparam,nohyb);
+	if (hilbs.S_TARGET >= 0) calc_S2(hilbs,hilbs.S_PENALTY,hilbs.S_TARGET);
 	return;
 }
 
@@ -253,3 +266,26 @@ void calc_HYB(Hilbert& hilbs, const HParam& hparam, bool nohyb) {
 	}
 	return;
 }
+
+void calc_S2(Hilbert& hilbs, double penalty, double S) {
+	// Total spin penalty, penalty * (S^2 - S(S+1)) with S^2 = S-S+ + Sz^2 + Sz. Vanishes for spin S,
+	// lower spin does not exist in the Sz = S block
+	int half = (hilbs.num_corb+hilbs.num_vorb)/2;
+	for (auto& r : hilbs.enum_hspace()) {
+		if (hilbs.sz_skipped(r)) continue;
+		ulli rd = r % (BIG1 << half), ru = r >> half;
+		ulli dn_only = rd & ~ru, up_only = ru & ~rd;
+		double sz = (ed::count_bits(ru) - ed::count_bits(rd))/2.0;
+		hilbs.fill_hblk(penalty*(sz*sz+sz+ed::count_bits(dn_only)-S*(S+1)),r,r);
+		// c+_{a,dn} c_{a,up} c+_{b,up} c_{b,dn}, as two spin flip hoppings
+		for (ulli a = up_only; a; a &= a - 1) {
+			for (ulli b = dn_only; b; b &= b - 1) {
+				ulli adn = a & -a, aup = adn << half, bdn = b & -b, bup = bdn << half;
+				ulli m = r - bdn + bup, l = m - aup + adn;
+				double sgn = hilbs.Fsign(&bdn,r,1)*hilbs.Fsign(&bup,m,1)*hilbs.Fsign(&aup,m,1)*hilbs.Fsign(&adn,l,1);
+				hilbs.fill_hblk(penalty*sgn,l,r);
+			}
+		}
+	}
+	return;
+}
@@ -12,6 +12,7 @@ void calc_CF(Hilbert& hilbs, const double* CF);
 void calc_SO(Hilbert& hilbs, const double lambda, int l_in);
 void calc_CV(Hilbert& hilbs, const double* FG);
 void calc_HYB(Hilbert& hilbs, const HParam& hparam, bool nohyb);
+void calc_S2(Hilbert& hilbs, double penalty, double S);
 
 
 #endif
\ No newline at end of file
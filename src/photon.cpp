@@ -38,15 +38,16 @@ dcomp proj_pvec(int ml, const vecd& pvec) {
 vecd occupation(Hilbert& hilbs, const vector<bindex>& si, bool is_print, string fname, bool spin_res) {
 	// Calculation occupation of orbitals, only valid when matrix is diagonalized
 	// There is a bug when calculating octahedral cluster????
-	for (auto& blk : hilbs.hblks) if (blk.eigvec == nullptr) throw runtime_error("matrix not diagonalized for occupation");
-	int nvo = hilbs.cluster->vo_persite, nco = hilbs.cluster->co_persite;
-	vecc U = hilbs.cluster->get_seph2real_mat();
+	for (auto& blk : hilbs.hblks) if (!blk.eigvec && !blk.compressed() && blk.nev) throw runtime_error("matrix not diagonalized for occupation");
+	int nvo = hilbs.cluster->vo_persite * hilbs.tot_site_num();
+	int nco = hilbs.cluster->co_persite * hilbs.tot_site_num();
+	vecc U = ed::make_blk_mat(hilbs.cluster->get_seph2real_mat(),hilbs.tot_site_num());
 	vector<double> occ_totsu(nvo,0), occ_totsd(nvo,0);
 	Hilbert minus_1vh(hilbs,-1);
 	int gs_count = 0;
 	for (auto &s  : si) {
 		auto& blk = hilbs.hblks[s.first];
-		if (spin_res && s.first >= (hilbs.hblks.size()+1)/2) continue;
+		if (spin_res && hilbs.BLOCK_DIAG && hilbs.S_TARGET < 0 && s.first >= (hilbs.hblks.size()+1)/2) continue;
 		gs_count++;
 		// Pick an operator
 		for (size_t c = 0; c < nvo; ++c) {
@@ -54,9 +55,8 @@ vecd occupation(Hilbert& hilbs, const vector<bindex>& si, bool is_print, string
 			vector<dcomp> wvfncsd(minus_1vh.hsize,0);
 			for (size_t ci = 0; ci < nvo; ++ci) {
 				if (abs(U[c*nvo+ci]) < TOL) continue;
-				for (size_t j = 0; j < blk.size; ++j) {
-					double sj = blk.eigvec[s.second*blk.size+j];
-					if (abs(sj) < TOL) continue;
+				blk.for_nonzero(s.second,[&](size_t j, double sj) {
+					if (abs(sj) < TOL) return;
 					// Operate on spin up and spin down
 					ulli op_state = hilbs.Hashback(bindex(s.first,j));
 					ulli opsu = BIG1 << (ci+nco), opsd = BIG1 << (ci+2*nco+nvo);
@@ -70,7 +70,7 @@ vecd occupation(Hilbert& hilbs, const vector<bindex>& si, bool is_print, string
 						int fsgn = hilbs.Fsign(&opsd,op_state,1);
 						wvfncsd[ind.second] += fsgn*sj*U[c*nvo+ci];
 					}
-				}
+				});
 			}
 			for (auto &w : wvfncsu) occ_totsu[c] += abs(pow(w,2));
 			for (auto &w : wvfncsd) occ_totsd[c] += abs(pow(w,2));
@@ -82,6 +82,7 @@ vecd occupation(Hilbert& hilbs, const vector<bindex>& si, bool is_print, string
 		occ_totsd[i] = occ_totsd[i]/gs_count;
 	}
 	for (int i = 0; i < nvo; ++i) occ_tot[i] = occ_totsd[i] + occ_totsu[i];
+	if (spin_res && hilbs.S_TARGET > 0) swap(occ_totsu,occ_totsd); // Sz = -S member, same as above
 	if (spin_res) {
 		// cout << "Spin up: " << endl;
 		hilbs.cluster->print_eigstate(occ_totsu,is_print,fname);
@@ -96,7 +97,7 @@ vecd occupation(Hilbert& hilbs, const vector<bindex>& si, bool is_print, string
 
 vecd occupation_test(Hilbert& hilbs, const vector<bindex>& si, bool is_print) {
 	// Calculation occupation of orbitals, only valid when matrix is diagonalized
-	for (auto& blk : hilbs.hblks) if (blk.eigvec == nullptr) throw runtime_error("matrix not diagonalized for occupation");
+	for (auto& blk : hilbs.hblks) if (!blk.eigvec && !blk.compressed() && blk.nev) throw runtime_error("matrix not diagonalized for occupation");
 	int nvo = hilbs.cluster->vo_persite * hilbs.tot_site_num();
 	int nco = hilbs.cluster->co_persite * hilbs.tot_site_num();
 	// cout << "NVO: " << nvo << ", NCO:" << nco << endl;
@@ -118,9 +119,8 @@ vecd occupation_test(Hilbert& hilbs, const vector<bindex>& si, bool is_print) {
 			vecc wvfnc(minus_1vh.hsize,0);
 			for (size_t ci = 0; ci < nvo; ++ci) {
 				if (abs(U[c*nvo+ci]) < TOL) continue;
-				for (size_t j = 0; j < blk.size; ++j) {
-					double sj = blk.eigvec[s.second*blk.size+j];
-					if (abs(sj) < TOL) continue;
+				blk.for_nonzero(s.second,[&](size_t j, double sj) {
+					if (abs(sj) < TOL) return;
 					// Operate on spin up and spin down
 					for (int sud = nco; sud <= 2*(nco+nvo); sud += nco+nvo) {
 						ulli op_state = hilbs.Hashback(bindex(s.first,j)), op;
@@ -131,7 +131,7 @@ vecd occupation_test(Hilbert& hilbs, const vector<bindex>& si, bool is_print) {
 						int fsgn = hilbs.Fsign(&op,op_state,1);
 						wvfnc[ind.second] += fsgn*sj*U[c*nvo+ci];
 					}
-				}
+				});
 			}
 			for (auto &w : wvfnc) occ_totc[c] += abs(pow(w,2))/si.size();
 		}
@@ -183,10 +183,10 @@ vector<double> wvfnc_weight(Hilbert& hilbs, const vector<bindex>& si, int ligNum
 	vector<double> wvfnc(hilbs.hsize), dLweight(ligNum+1,0);
 	for (auto& s : si) {
 		auto &blk = hilbs.hblks[s.first];
-		for (size_t i = 0; i < blk.size; ++i) {
+		blk.for_nonzero(s.second,[&](size_t i, double c) {
 			// Calculate Wavefunction
-			if (abs(blk.eigvec[s.second*blk.size+i]) < TOL) continue;
-			wvfnc[blk.f_ind+i] += pow(blk.eigvec[s.second*blk.size+i],2);
+			if (abs(c) < TOL) return;
+			wvfnc[blk.f_ind+i] += pow(c,2);
 			ulli state = hilbs.Hashback(bindex(s.first,i));
 			int Lcnt = 0;
 			// This needs to account geometry, Need a cleaner solution?
@@ -194,8 +194,8 @@ vector<double> wvfnc_weight(Hilbert& hilbs, const vector<bindex>& si, int ligNum
 				if ((BIG1<<(j+hilbs.num_corb/2)) & state) Lcnt++;
 				if ((BIG1<<(j+hilbs.num_corb+hilbs.num_vorb/2)) & state) Lcnt++;
 			}
-			if (Lcnt <= ligNum) dLweight[Lcnt] += pow(blk.eigvec[s.second*blk.size+i],2)/si.size();
-		}
+			if (Lcnt <= ligNum) dLweight[Lcnt] += pow(c,2)/si.size();
+		});
 	}
 	if (print) {
 		cout << "Ground State composition";
@@ -216,18 +216,14 @@ double effective_delta(Hilbert& hilbs, int ligNum, bool is_print) {
 	double d, dL;
 	ligNum = (ligNum < hilbs.num_vh) ? ligNum : hilbs.num_vh;
 	vector<bool> firstLh(ligNum+1,true);
-	auto all_eig = hilbs.get_all_eigval(false);
-	vector<double> distinct = ed::printDistinct(all_eig,0.0,all_eig.size(),is_print);
+	hilbs.index_eigval();
+	vector<double> distinct = hilbs.level_en;
+	if (is_print) {
+		for (auto& e : distinct) cout << e << " ";
+		cout << endl;
+	}
 	for (size_t e = 0; e < distinct.size(); ++e) {
-		vector<bindex> gei;
-		for (size_t i = 0; i < hilbs.hblks.size(); ++i) {
-			if (hilbs.hblks[i].eig == nullptr) continue;
-			for (size_t j = 0; j < hilbs.hblks[i].nev; ++j) {
-				if (abs(hilbs.hblks[i].eig[j]-distinct[e]) < TOL) {
-					gei.push_back({i,j});
-				}
-			}
-		}
+		vector<bindex> gei = hilbs.level_states(e);
 
 		vector<double> dLweight = wvfnc_weight(hilbs,gei,ligNum,false);
 		for (size_t i = 0; i <= ligNum; ++i) {
@@ -252,10 +248,10 @@ void state_composition(Hilbert& hilbs, const vector<bindex>& si, size_t top) {
 	vector<double> wvfnc(hilbs.hsize);
 	for (auto& s : si) {
 		auto &blk = hilbs.hblks[s.first];
-		for (size_t i = 0; i < blk.size; ++i) {
-			if (abs(blk.eigvec[s.second*blk.size+i]) < TOL) continue;
-			wvfnc[blk.f_ind+i] += pow(blk.eigvec[s.second*blk.size+i],2);
-		}
+		blk.for_nonzero(s.second,[&](size_t i, double c) {
+			if (abs(c) < TOL) return;
+			wvfnc[blk.f_ind+i] += pow(c,2);
+		});
 	}
 	double wv_sum = 0;
 	// Find index of state in wavefunction with top weight
@@ -276,44 +272,160 @@ void state_composition(Hilbert& hilbs, const vector<bindex>& si, size_t top) {
 	return;
 }
 
-void basis_overlap(Hilbert& GS, Hilbert& EX, bindex inds, vector<blapIndex>& blap, 
-					const PM& pm, bool pvout) {
-	// Calculate basis state overlap base on the indices of the blocks
-	size_t gbi = inds.first, exi = inds.second;
-	blap.clear();
-	blap.reserve(EX.hblks[exi].size*2); // rough guess
-	vecd pvec = pvout ? pm.pvout : pm.pvin;
-	int cl = GS.atlist[0].l, vl = GS.atlist[GS.atlist[0].vind].l;
+double dipole_qamp(Hilbert& GS, Hilbert& EX, ulli ch, ulli vh, int& q) {
+	// Dipole amplitude between a core hole and a valence hole of spherical component q, without 
+	// fermion signs and polarization
 	int half_orb = (EX.num_vorb+EX.num_corb)/2;
-	const int gsblk_size = GS.hblks[gbi].size;
-	const int exblk_size = EX.hblks[exi].size;
+	int coi = EX.orbind(ch), voi = GS.atlist[coi].vind;
+	q = 0;
+	if (!ed::is_pw2(vh) || !GS.atlist[voi].contains(vh)) return 0;
+	QN chqn = EX.atlist[coi].fast_qn(ch,half_orb,coi);
+	QN vhqn = GS.atlist[voi].fast_qn(vh,half_orb,voi);
+	if (chqn.spin != vhqn.spin || abs(vhqn.ml-chqn.ml) > 1) return 0;
+	q = vhqn.ml-chqn.ml;
+	return gaunt(EX.atlist[coi].l,chqn.ml,GS.atlist[voi].l,vhqn.ml)[1] * pow(-1,q+1);
+}
+
+dcomp dipole_amp(Hilbert& GS, Hilbert& EX, ulli ch, ulli vh, const vecd& pvec) {
+	// Dipole amplitude between a core hole and a valence hole, without fermion signs
+	int q;
+	double amp = dipole_qamp(GS,EX,ch,vh,q);
+	if (amp == 0) return 0;
+	return amp * proj_pvec(q,pvec);
+}
+
+vector<blapQIndex> dipole_components(Hilbert& GS, Hilbert& EX, bindex inds) {
+	// <e|D_q|g> of a pair of blocks. Every valence hole of a GS state is moved to each core 
+	// orbital and the result is hashed into the EX block. Entries are sorted by GS then EX state
+	size_t gbi = inds.first, exi = inds.second;
+	const size_t gsblk_size = GS.hblks[gbi].size;
+	int nco = EX.num_corb/2, half_orb = (EX.num_vorb+EX.num_corb)/2;
+	vector<ulli> core;
+	for (int c = 0; c < nco; ++c) {
+		core.push_back(BIG1 << c);
+		core.push_back(BIG1 << (c+half_orb));
+	}
 	vector<ulli> gslist = GS.get_hashback_list(gbi);
-	vector<ulli> exslist = EX.get_hashback_list(exi);
-	#pragma omp parallel for shared(blap,gslist,exslist) collapse(2)
+	vector<vector<blapQIndex>> rows(gsblk_size);
+	#pragma omp parallel for shared(rows,gslist,core) schedule(dynamic,64)
 	for (size_t g = 0; g < gsblk_size; g++) {
-		for (size_t e = 0; e < exblk_size; e++) {
-			ulli gs = gslist.at(g), exs = exslist.at(e);
-			ulli ch = exs - (gs & exs), vh = gs - (gs & exs);
-			int coi = EX.orbind(ch), voi = GS.atlist[coi].vind;
-			if (!ed::is_pw2(vh) || !GS.atlist[voi].contains(vh)) continue;
-			QN chqn = EX.atlist[coi].fast_qn(ch,half_orb,coi);
-			QN vhqn = GS.atlist[voi].fast_qn(vh,half_orb,voi);
-			if (chqn.spin != vhqn.spin || abs(vhqn.ml-chqn.ml) > 1) continue;
-			// dcomp blap_val = gaunt(cl,chqn.ml,vl,vhqn.ml)[1] 
-			// 	* GS.Fsign(&vh,gs,1) * EX.Fsign(&ch,exs,1) * proj_pvec(vhqn.ml-chqn.ml,pvec);
-			dcomp blap_val = gaunt(cl,chqn.ml,vl,vhqn.ml)[1] * pow(-1,vhqn.ml-chqn.ml+1)
-				* GS.Fsign(&vh,gs,1) * EX.Fsign(&ch,exs,1) * proj_pvec(vhqn.ml-chqn.ml,pvec);
-			if (blap_val != dcomp(0.0,0.0)) {
-				#pragma omp critical
-				{	
-					blap.emplace_back(g,e,blap_val);
-				}
+		ulli gs = gslist[g];
+		for (ulli holes = gs; holes; holes &= holes-1) {
+			ulli vh = holes & (~holes+1);
+			for (auto ch : core) {
+				if (ch & gs) continue;
+				int q;
+				double amp = dipole_qamp(GS,EX,ch,vh,q);
+				if (amp == 0) continue;
+				ulli exs = gs - vh + ch;
+				bindex ind = EX.Hash(exs);
+				if (ind.first != exi) continue;
+				rows[g].emplace_back(g,ind.second,amp*GS.Fsign(&vh,gs,1)*EX.Fsign(&ch,exs,1),q);
 			}
 		}
+		sort(rows[g].begin(),rows[g].end(),[](const blapQIndex& a, const blapQIndex& b){return a.e < b.e;});
+	}
+	vector<blapQIndex> comp;
+	for (auto& r : rows) {
+		comp.insert(comp.end(),r.begin(),r.end());
+		vector<blapQIndex>().swap(r);
+	}
+	return comp;
+}
+
+void basis_overlap(Hilbert& GS, Hilbert& EX, bindex inds, DipoleOp& blap, 
+					const PM& pm, bool pvout, DipoleCache* cache) {
+	// Calculate basis state overlap base on the indices of the blocks, the q components are 
+	// combined with the polarization. If cache is set they are only generated once per pair
+	size_t gbi = inds.first, exi = inds.second;
+	vecd pvec = pvout ? pm.pvout : pm.pvin;
+	const size_t gsblk_size = GS.hblks[gbi].size;
+	const size_t exblk_size = EX.hblks[exi].size;
+	vector<blapQIndex> local;
+	const vector<blapQIndex>* comp = &local;
+	if (cache && cache->count(inds)) comp = &cache->at(inds);
+	else if (cache) comp = &((*cache)[inds] = dipole_components(GS,EX,inds));
+	else local = dipole_components(GS,EX,inds);
+	dcomp proj[3] = {proj_pvec(-1,pvec), proj_pvec(0,pvec), proj_pvec(1,pvec)};
+	// Both orientations
+	blap.blap.clear();
+	blap.gptr = vector<size_t>(gsblk_size+1,0);
+	blap.eptr = vector<size_t>(exblk_size+1,0);
+	for (auto& c : *comp) {
+		dcomp blap_val = c.amp * proj[c.q+1];
+		if (blap_val == dcomp(0.0,0.0)) continue;
+		blap.blap.emplace_back(c.g,c.e,blap_val);
+		blap.gptr[c.g+1]++;
+		blap.eptr[c.e+1]++;
 	}
+	for (size_t g = 0; g < gsblk_size; g++) blap.gptr[g+1] += blap.gptr[g];
+	for (size_t e = 0; e < exblk_size; e++) blap.eptr[e+1] += blap.eptr[e];
+	blap.eord = vector<size_t>(blap.size());
+	vector<size_t> pos(blap.eptr.begin(),blap.eptr.end()-1);
+	for (size_t k = 0; k < blap.size(); ++k) blap.eord[pos[blap[k].e]++] = k;
 	return;
 }
 
+vecc project_dipole(const Block<double>& blk, size_t n, size_t exblk_size, const DipoleOp& blap) {
+	// D|n> in the basis of the core-hole block, for eigenvectors kept compressed
+	vecd vec(blk.size);
+	vecc dvec(exblk_size,0);
+	blk.get_vec(n,vec.data());
+	#pragma omp parallel for schedule(dynamic,256)
+	for (size_t e = 0; e < exblk_size; ++e) {
+		for (size_t k = blap.eptr[e]; k < blap.eptr[e+1]; ++k) {
+			auto& b = blap[blap.eord[k]];
+			dvec[e] += vec[b.g] * b.blap;
+		}
+	}
+	return dvec;
+}
+
+vecc transition_matrix(const Block<double>& exblk, const Block<double>& gsblk, const vector<size_t>& gsn,
+						const DipoleOp& blap) {
+	// <v|D|g> of every eigenvector v of exblk and eigenvectors gsn of gsblk, stored as 
+	// [g*exblk.nev+v]. D.V_gs is formed row by row, then one GEMM with the EX eigenvectors
+	int n = exblk.size, nev = exblk.nev, ng = gsn.size(), nc = 2*ng;
+	vecc tmat(size_t(nev)*ng,0);
+	if (!nev || !ng) return tmat;
+	// Rows of V_gs and D.V_gs are contiguous, D.V_gs keeps real and imaginary parts apart
+	vecd vgs(gsblk.size*ng), vec(gsblk.size), dv(size_t(n)*nc,0);
+	for (int c = 0; c < ng; ++c) {
+		gsblk.get_vec(gsn[c],vec.data());
+		for (size_t i = 0; i < gsblk.size; ++i) vgs[i*ng+c] = vec[i];
+	}
+	#pragma omp parallel for schedule(dynamic,256)
+	for (int e = 0; e < n; ++e) {
+		double* d = &dv[size_t(e)*nc];
+		for (size_t k = blap.eptr[e]; k < blap.eptr[e+1]; ++k) {
+			auto& b = blap[blap.eord[k]];
+			const double* vg = &vgs[b.g*ng];
+			for (int c = 0; c < ng; ++c) {
+				dcomp x = vg[c] * b.blap;
+				d[c] += x.real();
+				d[c+ng] += x.imag();
+			}
+		}
+	}
+	vecd t(size_t(nev)*nc,0);
+	if (exblk.compressed()) {
+		#pragma omp parallel for schedule(dynamic)
+		for (int v = 0; v < nev; ++v) {
+			exblk.for_nonzero(v,[&](size_t e, double x) {
+				for (int c = 0; c < nc; ++c) t[size_t(c)*nev+v] += x * dv[e*nc+c];
+			});
+		}
+	} else {
+		char TR = 'T';
+		double one = 1, zero = 0;
+		_gemm(&TR,&TR,&nev,&nc,&n,&one,exblk.eigvec.get(),&n,dv.data(),&nc,&zero,t.data(),&nev);
+	}
+	for (size_t c = 0; c < ng; ++c) {
+		for (size_t v = 0; v < nev; ++v) tmat[c*nev+v] = dcomp(t[c*nev+v],t[(c+ng)*nev+v]);
+	}
+	return tmat;
+}
+
 void XAS_peak_occupation(Hilbert& GS, Hilbert& EX, vecd const& peak_en, vecd const& energy, 
 						vecd const& intensity, vector<bindex> const& gsi, double ref_en, 
 						string mode, bool ref_gs) {
@@ -335,13 +447,7 @@ void XAS_peak_occupation(Hilbert& GS, Hilbert& EX, vecd const& peak_en, vecd con
 	}
 	vecd occ_gs = ref_gs ? occupation(GS,gsi,false) : vecd(GS.num_vorb/2,0);
 	for (size_t p = 0; p < peak_en_copy.size(); p++) {
-		vector<bindex> peaks;
-		for (auto &blk : EX.hblks) {	
-			for (size_t i = 0; i < blk.nev; ++i) {
-				if (abs(blk.eig[i]-ref_en-peak_en_copy[p]) < 1e-8) 
-					peaks.push_back(bindex(&blk-&EX.hblks[0],i));
-			}
-		}
+		vector<bindex> peaks = EX.eig_near(ref_en+peak_en_copy[p],1e-8);
 		if (mode == "top" && abs(intensity[indices[p]]) < PRINT_TOL) break;
 		cout << "PEAK " << p+1;
 		if (mode == "top") cout << ", intensity: " << intensity[indices[p]] << endl;
@@ -372,33 +478,69 @@ void write_XAS(vecd const& aben, vecd const& intensity, string file_dir, bool ex
 }
 
 
-void XAS(Hilbert& GS, Hilbert& EX, const PM& pm) {
+void write_cfe(const vector<CFECoef>& cfes, string file_dir) {
+	// Binary: number of records, then gsblk, exblk, inc_en, E0, factor, n, alpha[n], betha[n]
+	if (ed::mpi_rank()) return;
+	ofstream cfile(file_dir,ios::binary);
+	size_t ncf = cfes.size();
+	cfile.write((char*)&ncf,sizeof(size_t));
+	for (auto& cf : cfes) {
+		size_t n = cf.alpha.size();
+		cfile.write((char*)&cf.gsblk,sizeof(int));
+		cfile.write((char*)&cf.exblk,sizeof(int));
+		cfile.write((char*)&cf.inc_en,sizeof(double));
+		cfile.write((char*)&cf.E0,sizeof(double));
+		cfile.write((char*)&cf.factor,sizeof(double));
+		cfile.write((char*)&n,sizeof(size_t));
+		cfile.write((char*)cf.alpha.data(),n*sizeof(double));
+		cfile.write((char*)cf.betha.data(),n*sizeof(double));
+	}
+	cout << "Lanczos coefficients written to " << file_dir << endl;
+	return;
+}
+
+vector<CFECoef> read_cfe(string file_dir) {
+	ifstream cfile(file_dir,ios::binary);
+	if (!cfile.good()) throw runtime_error("Cannot open " + file_dir);
+	size_t ncf = 0;
+	cfile.read((char*)&ncf,sizeof(size_t));
+	vector<CFECoef> cfes(ncf);
+	for (auto& cf : cfes) {
+		size_t n = 0;
+		cfile.read((char*)&cf.gsblk,sizeof(int));
+		cfile.read((char*)&cf.exblk,sizeof(int));
+		cfile.read((char*)&cf.inc_en,sizeof(double));
+		cfile.read((char*)&cf.E0,sizeof(double));
+		cfile.read((char*)&cf.factor,sizeof(double));
+		cfile.read((char*)&n,sizeof(size_t));
+		cf.alpha.resize(n);
+		cf.betha.resize(n);
+		cfile.read((char*)cf.alpha.data(),n*sizeof(double));
+		cfile.read((char*)cf.betha.data(),n*sizeof(double));
+	}
+	if (!cfile.good()) throw runtime_error("Corrupted Lanczos coefficient file " + file_dir);
+	return cfes;
+}
+
+void XAS(Hilbert& GS, Hilbert& EX, const PM& pm, DipoleCache* cache) {
 	// Note: different diagonalize routine might yield different results, 
 	// if the width of delta function is not small enough.
 	double beta = 0, nedos = pm.nedos;//, racah_B = (SC[2]/49) - (5*SC[4]/441);
 
-	if (GS.hblks[0].eig == nullptr) throw runtime_error("Hamiltonian not diagonalized");
-	double gs_en = GS.hblks[0].eig[0], ex_en;
-	if (!pm.skip_ch_diag) {
-		if (EX.hblks[0].eig == nullptr) throw runtime_error("Hamiltonian not diagonalized");
-		ex_en = EX.hblks[0].eig[0];
-	}
-	for (auto &gsb : GS.hblks) for (size_t i = 0; i < gsb.nev; ++i) if (gsb.eig[i] <= gs_en) gs_en = gsb.eig[i];
-	vector<bindex> gsi; // index for ground state
+	double gs_en = GS.min_eigval(), ex_en;
+	if (!pm.skip_ch_diag) ex_en = EX.min_eigval();
+	vector<bindex> gsi = GS.eig_near(gs_en); // index for ground state
 	// Calculate Partition function
 	double Z = 0, emin = pm.ab_range[0], emax = pm.ab_range[1], SDegen = 0;
-	for (size_t i = 0; i < GS.hblks.size(); ++i) {
-	for (size_t j = 0; j < GS.hblks[i].nev; ++j) {
-		if (abs(GS.hblks[i].eig[j]-gs_en) < TOL) {
-			Z += exp(-beta*GS.hblks[i].eig[j]);
-			if (abs(GS.hblks[i].get_sz()) >= SDegen) SDegen = abs(GS.hblks[i].get_sz());
-			gsi.push_back({i,j});
-		}
-	}}
+	for (auto& g : gsi) {
+		Z += exp(-beta*GS.hblks[g.first].eig[g.second]);
+		if (abs(GS.hblks[g.first].get_sz()) >= SDegen) SDegen = abs(GS.hblks[g.first].get_sz());
+	}
 
 	cout << "Calculating cross section..." << endl;
 	auto start = chrono::high_resolution_clock::now();
-	vector<blapIndex> blap;
+	DipoleOp blap;
+	int dirr = GS.op_irrep([&](ulli c, ulli v){return dipole_amp(GS,EX,c,v,pm.pvin);});
 
 	vecd xas_aben(nedos,0), xas_int(nedos,0);
 	bool write_output = true;
@@ -407,52 +549,60 @@ void XAS(Hilbert& GS, Hilbert& EX, const PM& pm) {
 		// Lanczos solver
 		for (int i = 0; i < nedos; ++i) 
 			xas_aben[i] = pm.ab_range[0] + (pm.ab_range[1]-pm.ab_range[0])/nedos*i;
+		vector<CFECoef> cfes;
 		for (auto &g  : gsi) {
 			size_t gblk_size =  GS.hblks[g.first].size;
 			for (auto &exblk : EX.hblks) {
 				size_t exblk_ind = &exblk-&EX.hblks[0];
 				// No spin flip
 				if (!GS.SO_on && !EX.SO_on && GS.hblks[g.first].get_sz() != exblk.get_sz()) continue;
-				cout << "gsblk: " << g.first << ", exblk: " << &exblk-&EX.hblks[0] << endl;
+				vecd gs_real(gblk_size);
 				vecc gs_vec(gblk_size,0);
+				GS.hblks[g.first].get_vec(g.second,gs_real.data());
 				#pragma omp parallel for
-				for (int i = 0; i < gblk_size; ++i) 
-					gs_vec[i] = dcomp(GS.hblks[g.first].eigvec[g.second*gblk_size+i],0);
-				basis_overlap(GS,EX,bindex(g.first,exblk_ind),blap,pm);
+				for (int i = 0; i < gblk_size; ++i) gs_vec[i] = dcomp(gs_real[i],0);
+				basis_overlap(GS,EX,bindex(g.first,exblk_ind),blap,pm,false,cache);
 				vecc dipole_vec = gen_dipole_state(GS,EX,pm,bindex(g.first,exblk_ind),gs_vec,blap);
+				// Jz blocks are not all dipole coupled
+				if (ed::norm(dipole_vec) == 0) continue;
+				cout << "gsblk: " << g.first << ", exblk: " << &exblk-&EX.hblks[0] << endl;
 				// Perform Lanczos
-				ContFracExpan(exblk.ham,dipole_vec,gs_en,xas_aben,xas_int,pm.eps_ab,pm.niterCFE);
+				CFECoef cf;
+				cf.gsblk = g.first;
+				cf.exblk = exblk_ind;
+				if (pm.kpm) KPMExpan(exblk.ham,dipole_vec,gs_en,xas_aben,xas_int,pm.eps_ab,pm.kpm,pm.kpm_kernel);
+				else ContFracExpan(exblk.ham,dipole_vec,gs_en,xas_aben,xas_int,pm.eps_ab,pm.niterCFE,
+								pm.save_cfe ? &cf : nullptr);
+				if (pm.save_cfe) cfes.push_back(move(cf));
 			}
 		}
+		if (pm.save_cfe) write_cfe(cfes,"XAS_"+pm.edge+"edge_"+pol_str(pm.pvin)+".cfe");
 		cout << "Finish solving Lanczos!" << endl;
 	} else {
 		for (auto &exblk : EX.hblks) {
-			size_t last_gs_block = gsi[0].first;
-			basis_overlap(GS,EX,bindex(last_gs_block,&exblk-&EX.hblks[0]),blap,pm);
-			for (auto &g  : gsi) {
-				auto& gsblk = GS.hblks[g.first];
-				// ed::print_progress((&exblk-&EX.hblks[0])*gsi.size()+(&g-&gsi[0])+1,EX.hblks.size()*gsi.size());
+			for (size_t g0 = 0, g1 = 0; g0 < gsi.size(); g0 = g1) {
+				// Degenerate ground states of one block share a transition matrix
+				vector<size_t> gsn;
+				for (g1 = g0; g1 < gsi.size() && gsi[g1].first == gsi[g0].first; ++g1) gsn.push_back(gsi[g1].second);
+				auto& gsblk = GS.hblks[gsi[g0].first];
+				// ed::print_progress((&exblk-&EX.hblks[0])*gsi.size()+g0+1,EX.hblks.size()*gsi.size());
 				if (!GS.SO_on && !EX.SO_on && gsblk.get_sz() != exblk.get_sz()) continue; // Spin order blocks
-				if (g.first != last_gs_block) {
-					basis_overlap(GS,EX,bindex(g.first,&exblk-&EX.hblks[0]),blap,pm);
-					last_gs_block = g.first;
-				}
+				basis_overlap(GS,EX,bindex(gsi[g0].first,&exblk-&EX.hblks[0]),blap,pm,false,cache);
+				vecc tmat = transition_matrix(exblk,gsblk,gsn,blap);
+				for (size_t gn = g0; gn < g1; ++gn) {
+				auto& g = gsi[gn];
 				#pragma omp parallel for reduction (vec_double_plus:xas_int) schedule(dynamic)
 				for (size_t ei = 0; ei < exblk.nev; ++ei) {
 					if (exblk.eig[ei]-gs_en < emin || exblk.eig[ei]-gs_en > emax) continue;
-					dcomp cs = 0;
-					for (auto & b : blap) {
-						size_t gsind = g.second*gsblk.size+b.g;
-						size_t exind = ei*exblk.size+b.e;
-						cs +=  gsblk.eigvec[gsind] * exblk.eigvec[exind] * b.blap;
-					}
+					if (!GS.dipole_allowed(EX,g,bindex(&exblk-&EX.hblks[0],ei),dirr)) continue;
+					dcomp cs = tmat[(gn-g0)*exblk.nev+ei];
 					if (abs(cs) > TOL) { // Is this arbritrary?????	
 						size_t peak_pos = round((exblk.eig[ei]-gs_en-emin)/((emax-emin)/nedos));
 						xas_aben[peak_pos] = exblk.eig[ei]-gs_en;
 						// Peaks position might be different if delta function is too wide, we can fix this by taking the smaller value
 						xas_int[peak_pos] += exp(-beta*gs_en)*pow(abs(cs),2);
 					}
-				}
+				}}
 			}
 		}
 		// Calculate peak intensity, TODO: output peaks?
@@ -467,6 +617,23 @@ void XAS(Hilbert& GS, Hilbert& EX, const PM& pm) {
 	return;
 }
 
+void XAS_from_cfe(const PM& pm) {
+	// Solver 4 XAS from the saved Lanczos coefficients, with the broadening and grid of pm
+	string fname = "XAS_"+pm.edge+"edge_"+pol_str(pm.pvin);
+	vector<CFECoef> cfes = read_cfe(fname+".cfe");
+	auto start = chrono::high_resolution_clock::now();
+	int nedos = pm.nedos;
+	vecd xas_aben(nedos,0), xas_int(nedos,0);
+	for (int i = 0; i < nedos; ++i) 
+		xas_aben[i] = pm.ab_range[0] + (pm.ab_range[1]-pm.ab_range[0])/nedos*i;
+	for (auto& cf : cfes) cfe_spectrum(cf,xas_aben,xas_int,pm.eps_ab);
+	auto stop = chrono::high_resolution_clock::now();
+	auto duration = chrono::duration_cast<chrono::milliseconds>(stop - start);
+	cout << "Spectrum from " << cfes.size() << " Lanczos runs, run time = " << duration.count() << " ms\n";
+	write_XAS(xas_aben,xas_int,fname+".txt",false);
+	return;
+}
+
 
 void RIXS_peak_occupation(Hilbert& GS, Hilbert& EX, vecd const& peak_en, vecd const& ab_en, 
 						vecd const& em_en, vecd const& intensity, vector<bindex> const& gsi,
@@ -496,23 +663,12 @@ void RIXS_peak_occupation(Hilbert& GS, Hilbert& EX, vecd const& peak_en, vecd co
 	}
 	vecd occ_gs = ref_gs ? occupation(GS,gsi,false) : vecd(GS.num_vorb/2,0);
 	for (size_t p = 0; p < peak_ab_en.size(); p++) {
-		vector<bindex> ab_peaks, em_peaks;
 		// Get absorption peaks
-		for (auto &blk : EX.hblks) {	
-			for (size_t i = 0; i < blk.nev; ++i) {
-				if (abs(blk.eig[i]-ref_en-peak_ab_en[p]) < TOL) 
-					ab_peaks.push_back(bindex(&blk-&EX.hblks[0],i));
-			}
-		}
+		vector<bindex> ab_peaks = EX.eig_near(ref_en+peak_ab_en[p]);
 		// Get emission peaks
 		double loss_en = pm.eloss ? peak_em_en[p] : peak_ab_en[p]-peak_em_en[p];
 		double tolerance = pm.eloss ? TOL : (2*pm.em_energy+pm.ab_range[1]-pm.ab_range[0])/ab_en.size();
-		for (auto &blk : GS.hblks) {	
-			for (size_t i = 0; i < blk.nev; ++i) {
-				if (abs(blk.eig[i]-ref_en-loss_en) < tolerance) 
-					em_peaks.push_back(bindex(&blk-&GS.hblks[0],i));
-			}
-		}
+		vector<bindex> em_peaks = GS.eig_near(ref_en+loss_en,tolerance);
 		if (mode == "top" && abs(intensity[indices[p]]) < PRINT_TOL) break;
 		cout << "PEAK " << p+1;
 		if (mode == "top") cout << ", intensity: " << intensity[indices[p]] << endl;
@@ -592,7 +748,7 @@ void write_iter_RIXS(vecd const& rixs_ab, vecd const& rixs_loss, vecd const& rix
 }
 
 vecc gen_dipole_state(Hilbert& GS, Hilbert& EX, const PM& pm, const bindex& inds, vecc vec_in, 
-						const vector<blapIndex>& blap, bool excite) {
+						const DipoleOp& blap, bool excite) {
 	size_t gbi = inds.first, exi = inds.second;
 	if (excite) {
 		// Generate excited state with D|g>
@@ -601,8 +757,12 @@ vecc gen_dipole_state(Hilbert& GS, Hilbert& EX, const PM& pm, const bindex& inds
 			exit(1);
 		}
 		vecc dpvec(EX.hblks[exi].size,0);
-		for (auto & b : blap) {
-			dpvec[b.e] += vec_in[b.g] * b.blap;
+		#pragma omp parallel for schedule(dynamic,256)
+		for (size_t e = 0; e < dpvec.size(); ++e) {
+			for (size_t k = blap.eptr[e]; k < blap.eptr[e+1]; ++k) {
+				auto& b = blap[blap.eord[k]];
+				dpvec[e] += vec_in[b.g] * b.blap;
+			}
 		}
 		return dpvec;
 	} else { // Generate excited state with D+|g>
@@ -611,22 +771,90 @@ vecc gen_dipole_state(Hilbert& GS, Hilbert& EX, const PM& pm, const bindex& inds
 			exit(1);
 		}
 		vecc dpvec(GS.hblks[gbi].size,0);
-		for (auto & b : blap) {
-			dpvec[b.g] += vec_in[b.e] * conj(b.blap);
+		#pragma omp parallel for schedule(dynamic,256)
+		for (size_t g = 0; g < dpvec.size(); ++g) {
+			for (size_t k = blap.gptr[g]; k < blap.gptr[g+1]; ++k) {
+				dpvec[g] += vec_in[blap[k].e] * conj(blap[k].blap);
+			}
 		}
 		return dpvec;
 	}
 }
 
-void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm) {
+vecc kh_amplitude(vector<pair<double,dcomp>> poles, double omega0, double step, size_t n_min, 
+					size_t n_max, double gamma, double window) {
+	// Kramers-Heisenberg amplitude sum_v a_v/(w-E_v+i*gamma) for w = omega0+n*step, n_min <= n < n_max,
+	// poles are (E_v, a_v). If window > 0, poles are binned by energy (width gamma) and a bin farther 
+	// than window*gamma from w only enters by its monopole and dipole moment, the error of a bin is
+	// below sum|a|*(gamma/2)^2/(window*gamma)^3
+	size_t nw = n_max > n_min ? n_max-n_min : 0;
+	vecd re(nw,0), im(nw,0);
+	vecc amp(nw,0);
+	if (poles.empty() || !nw) return amp;
+	sort(poles.begin(),poles.end(),[](const pair<double,dcomp>& a, const pair<double,dcomp>& b){return a.first < b.first;});
+	vector<size_t> bfirst;
+	vecd bcen;
+	vecc bmono, bdip;
+	double h = gamma, emin = poles[0].first;
+	for (size_t p = 0; p < poles.size(); ++p) {
+		double c = window > 0 ? emin+(floor((poles[p].first-emin)/h)+0.5)*h : 0;
+		if (bfirst.empty() || c != bcen.back()) {
+			bfirst.push_back(p);
+			bcen.push_back(c);
+			bmono.push_back(0);
+			bdip.push_back(0);
+		}
+		bmono.back() += poles[p].second;
+		bdip.back() += poles[p].second*(poles[p].first-c);
+	}
+	bfirst.push_back(poles.size());
+	double g2 = gamma*gamma, reach = window*gamma+h/2;
+	#pragma omp parallel for schedule(dynamic)
+	for (size_t n0 = n_min; n0 < n_max; n0 += 256) {
+		size_t n1 = min(n_max,n0+256);
+		for (size_t b = 0; b < bcen.size(); ++b) {
+			// Poles of a bin close to w are summed exactly
+			size_t lo = n0, hi = n1;
+			if (window > 0) {
+				double nlo = ceil((bcen[b]-reach-omega0)/step), nhi = floor((bcen[b]+reach-omega0)/step)+1;
+				lo = min(n1,size_t(max(double(n0),nlo)));
+				hi = max(lo,min(n1,size_t(max(double(n0),nhi))));
+			}
+			for (size_t p = bfirst[b]; p < bfirst[b+1]; ++p) {
+				double en = poles[p].first, ar = poles[p].second.real(), ai = poles[p].second.imag();
+				#pragma omp simd
+				for (size_t n = lo; n < hi; ++n) {
+					double x = omega0+n*step-en, d = 1/(x*x+g2);
+					re[n-n_min] += (ar*x+ai*gamma)*d;
+					im[n-n_min] += (ai*x-ar*gamma)*d;
+				}
+			}
+			if (window <= 0) continue;
+			// Far bins, A/z + M/z^2 with z = w-c+i*gamma
+			double mr = bmono[b].real(), mi = bmono[b].imag(), dr = bdip[b].real(), di = bdip[b].imag();
+			auto far = [&](size_t from, size_t to) {
+				#pragma omp simd
+				for (size_t n = from; n < to; ++n) {
+					double x = omega0+n*step-bcen[b], d = 1/(x*x+g2);
+					double u = x*d, v = -gamma*d, p = u*u-v*v, q = 2*u*v;
+					re[n-n_min] += mr*u-mi*v + dr*p-di*q;
+					im[n-n_min] += mr*v+mi*u + dr*q+di*p;
+				}
+			};
+			far(n0,lo);
+			far(hi,n1);
+		}
+	}
+	for (size_t n = 0; n < nw; ++n) amp[n] = dcomp(re[n],im[n]);
+	return amp;
+}
+
+void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm, DipoleCache* cache) {
 	double beta = 0, hbar = 6.58e-16, nedos = pm.nedos, eloss_min = -2;
 	dcomp igamma(0,pm.eps_loss);
 
-	if (GS.hblks[0].eig == nullptr) throw runtime_error("Hamiltonian not diagonalized");
-	if (!pm.skip_ch_diag and EX.hblks[0].eig == nullptr) throw runtime_error("Hamiltonian not diagonalized");
-
-	double gs_en = GS.hblks[0].eig[0];
-	for (auto &gsb : GS.hblks) for (size_t i = 0; i < gsb.nev; ++i) if (gsb.eig[i] <= gs_en) gs_en = gsb.eig[i];
+	double gs_en = GS.min_eigval();
+	if (!pm.skip_ch_diag && EX.get_all_eigval(false).empty()) throw runtime_error("Hamiltonian not diagonalized");
 	vector<bindex> gsi,exi; // index for ground state and excited states
 	double Z = 0, ab_emin = pm.ab_range[0], ab_emax = pm.ab_range[1], elm_min, elm_max;
 	if (pm.eloss) { // Energy Loss
@@ -636,25 +864,117 @@ void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm) {
 		elm_max = ab_emax + pm.em_energy;
 		elm_min = ab_emin - pm.em_energy;
 	}
-	for (size_t i = 0; i < GS.hblks.size(); ++i) {
-	for (size_t j = 0; j < GS.hblks[i].nev; ++j) {
-		if (abs(GS.hblks[i].eig[j]-gs_en) < TOL) {
-			gsi.push_back({i,j});
-			Z += exp(-beta*GS.hblks[i].eig[j]);
-		}
-	}} 
+	gsi = GS.eig_near(gs_en);
+	for (auto& g : gsi) Z += exp(-beta*GS.hblks[g.first].eig[g.second]);
 
 	cout << "Calculating cross section..." << endl;
 	auto start = chrono::high_resolution_clock::now();
 	vecd rixs_em, rixs_ab, rixs_peaks, rixs_peaks_kh, rixs_em_kh;
-	vector<blapIndex> blap;
+	DipoleOp blap;
+	int dirr_in = GS.op_irrep([&](ulli c, ulli v){return dipole_amp(GS,EX,c,v,pm.pvin);});
+	int dirr_out = GS.op_irrep([&](ulli c, ulli v){return dipole_amp(GS,EX,c,v,pm.pvout);});
 
 	if (pm.spec_solver == 4) {
 		// BiCGstab and Lanczos to solve RIXS spectra
+		vector<CFECoef> cfes;
+		auto excitation = [&](const bindex& g, size_t exblk_ind) {
+			// D|g> in an EX block, empty if the pair is not dipole coupled
+			auto& exblk = EX.hblks[exblk_ind];
+			size_t gblk_size = GS.hblks[g.first].size;
+			if (!GS.SO_on && !EX.SO_on && GS.hblks[g.first].get_sz() != exblk.get_sz()) return vecc();
+			vecd gs_real(gblk_size);
+			vecc gs_vec(gblk_size,0);
+			GS.hblks[g.first].get_vec(g.second,gs_real.data());
+			#pragma omp parallel for
+			for (int i = 0; i < gblk_size; ++i) gs_vec[i] = dcomp(gs_real[i],0);
+			basis_overlap(GS,EX,bindex(g.first,exblk_ind),blap,pm,false,cache);
+			vecc dipole_vec = gen_dipole_state(GS,EX,pm,bindex(g.first,exblk_ind),gs_vec,blap);
+			if (ed::norm(dipole_vec) == 0) return vecc();
+			cout << "Block: " << g.first << ", " << exblk_ind << endl;
+			return dipole_vec;
+		};
+		auto emission = [&](double ab_en, const vector<vecc>& midvecs, vecd& em, vecd& peaks) {
+			// De-excitation of the intermediate state, midvecs holds its part in every EX block. 
+			// A final block can be reached through several EX blocks (Jz blocks, q = +-1), the 
+			// parts D+|v> are added before the Lanczos for the loss spectrum
+			for (auto &fsblk : GS.hblks) {
+				size_t fsblk_ind = &fsblk-&GS.hblks[0];
+				vecc fsvec;
+				for (auto &exblk : EX.hblks) {
+					size_t exblk_ind = &exblk-&EX.hblks[0];
+					if (midvecs[exblk_ind].empty()) continue;
+					if (!GS.SO_on && !EX.SO_on && fsblk.get_sz() != exblk.get_sz()) continue;
+					basis_overlap(GS,EX,bindex(fsblk_ind,exblk_ind),blap,pm,true,cache);
+					if (!blap.size()) continue;
+					vecc dvec = gen_dipole_state(GS,EX,pm,bindex(fsblk_ind,exblk_ind),midvecs[exblk_ind],blap,false);
+					if (fsvec.empty()) fsvec.swap(dvec);
+					else for (size_t i = 0; i < fsvec.size(); ++i) fsvec[i] += dvec[i];
+				}
+				if (fsvec.empty() || ed::norm(fsvec) == 0) continue;
+				if (pm.kpm) {
+					KPMExpan(fsblk.ham,fsvec,gs_en,em,peaks,pm.eps_loss,pm.kpm,pm.kpm_kernel);
+					continue;
+				}
+				int niter_CFE_in = pm.niterCFE;
+				if (niter_CFE_in > fsblk.size/100) niter_CFE_in = fsblk.size/100;
+				if (niter_CFE_in < 20) niter_CFE_in = 20; 
+				cout << "Number of Lanczos Iteration: " << niter_CFE_in << endl;
+				CFECoef cf;
+				cf.gsblk = fsblk_ind;
+				cf.exblk = -1;
+				cf.inc_en = ab_en;
+				ContFracExpan(fsblk.ham,fsvec,gs_en,em,peaks,pm.eps_loss,niter_CFE_in,
+								pm.save_cfe ? &cf : nullptr);
+				if (pm.save_cfe) cfes.push_back(move(cf));
+			}
+		};
+		if (pm.multi_shift) {
+			// All incident energies share one Krylov sequence per block
+			size_t ninc = pm.inc_e_points.size();
+			vecc zs(ninc);
+			for (size_t k = 0; k < ninc; ++k) zs[k] = dcomp(gs_en+pm.inc_e_points[k],-pm.eps_ab);
+			vecd rixs_em_local(nedos,0);
+			vector<vecd> rixs_peaks_local(ninc,vecd(nedos,0));
+			for (int i = 0; i < nedos; ++i) rixs_em_local[i] = -2 + (pm.em_energy+2)/nedos*i;
+			for (auto &g  : gsi) {
+				vector<vecc> dipole_vecs(EX.hblks.size());
+				size_t max_size = 0;
+				for (auto &exblk : EX.hblks) {
+					dipole_vecs[&exblk-&EX.hblks[0]] = excitation(g,&exblk-&EX.hblks[0]);
+					if (!dipole_vecs[&exblk-&EX.hblks[0]].empty()) max_size = max(max_size,exblk.size);
+				}
+				if (!max_size) continue;
+				// Every shift keeps two vectors of the block in the solver (solution and search 
+				// direction) and the intermediate state in all EX blocks until the emission, groups 
+				// of shifts use at most a quarter of the memory
+				size_t group = 0.25*ed::phys_mem()/(32.0*max_size+16.0*EX.hsize);
+				group = max(size_t(1),min(ninc,group));
+				if (group < ninc) cout << "Shifts are solved in groups of " << group << endl;
+				for (size_t k0 = 0; k0 < ninc; k0 += group) {
+					size_t k1 = min(ninc,k0+group);
+					vector<vector<vecc>> midvecs(k1-k0,vector<vecc>(EX.hblks.size()));
+					for (auto &exblk : EX.hblks) {
+						size_t exblk_ind = &exblk-&EX.hblks[0];
+						if (dipole_vecs[exblk_ind].empty()) continue;
+						vector<vecc> xs = shifted_COCG(exblk.ham,dipole_vecs[exblk_ind],vecc(zs.begin()+k0,zs.begin()+k1),pm.CG_tol);
+						for (size_t k = k0; k < k1; ++k) midvecs[k-k0][exblk_ind].swap(xs[k-k0]);
+					}
+					for (size_t k = k0; k < k1; ++k) {
+						cout << "Incident energy: " << pm.inc_e_points[k] << endl;
+						emission(pm.inc_e_points[k],midvecs[k-k0],rixs_em_local,rixs_peaks_local[k]);
+						vector<vecc>().swap(midvecs[k-k0]);
+					}
+				}
+			}
+			for (size_t k = 0; k < ninc; ++k) {
+				write_iter_RIXS(vecd(nedos,pm.inc_e_points[k]),rixs_em_local,rixs_peaks_local[k],
+					"RIXS_"+pm.edge+"edge_"+pol_str(pm.pvin)+"_"+pol_str(pm.pvout)+".txt",k == 0);
+			}
+		}
 		// Solve for each incident energy, not super efficient
 		vecc solved_vec;
 		if (pm.precond != 0) solved_vec = vecc(EX.hsize,0);
-		for (auto &ab_en: pm.inc_e_points) {
+		if (!pm.multi_shift) for (auto &ab_en: pm.inc_e_points) {
 			cout << "---------------Solving for incident energy: " << ab_en << "---------------" << endl;
 			dcomp z(gs_en+ab_en,-pm.eps_ab);
 			vecd rixs_ab_local(nedos,ab_en);
@@ -663,38 +983,27 @@ void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm) {
 			// Using previous coverged vector as guess, use a vector with size = Hilbert space
 			for (int i = 0; i < nedos; ++i) rixs_em_local[i] = -2 + (pm.em_energy+2)/nedos*i;
 			for (auto &g  : gsi) {
-				size_t gblk_size =  GS.hblks[g.first].size;
+				// Intermediate state in every EX block
+				vector<vecc> midvecs(EX.hblks.size());
 				for (auto &exblk : EX.hblks) {
 					size_t exblk_ind = &exblk-&EX.hblks[0];
-					if (!GS.SO_on && !EX.SO_on && GS.hblks[g.first].get_sz() != exblk.get_sz()) continue;
-					cout << "Block: " << g.first << ", " << exblk_ind << endl;
-					vecc gs_vec(gblk_size,0);
-					#pragma omp parallel for
-					for (int i = 0; i < gblk_size; ++i) 
-						gs_vec[i] = dcomp(GS.hblks[g.first].eigvec[g.second*gblk_size+i],0);
-					basis_overlap(GS,EX,bindex(g.first,exblk_ind),blap,pm);
-					vecc dipole_vec = gen_dipole_state(GS,EX,pm,bindex(g.first,exblk_ind),gs_vec,blap);
-					// Perform BiCGS, solve for intermediate state
+					vecc dipole_vec = excitation(g,exblk_ind);
+					if (dipole_vec.empty()) continue;
+					// Solve for intermediate state
 					vecc guess_vec;
 					if (pm.precond != 0 && ab_en != pm.inc_e_points[0]) {
 						guess_vec = vecc(exblk.size,0);
 						std::copy(solved_vec.begin()+exblk.f_ind, 
 							solved_vec.begin()+exblk.f_ind+exblk.size, guess_vec.begin());
 					}
-					vecc midvec = BiCGS(exblk.ham,dipole_vec,z,pm.CG_tol,guess_vec);
+					vecc& midvec = midvecs[exblk_ind];
+					if (pm.mid_solver == 1) midvec = COCG(exblk.ham,dipole_vec,z,pm.CG_tol,guess_vec);
+					else if (pm.mid_solver == 2) midvec = COCR(exblk.ham,dipole_vec,z,pm.CG_tol,guess_vec);
+					else midvec = BiCGS(exblk.ham,dipole_vec,z,pm.CG_tol,guess_vec);
 					if (pm.precond != 0) std::copy(midvec.begin(), midvec.end(), solved_vec.begin()+exblk.f_ind);
-					// De-excitation
-					if (pm.pvin != pm.pvout) {
-						basis_overlap(GS,EX,bindex(g.first,exblk_ind),blap,pm,true);
-					}
-					midvec = gen_dipole_state(GS,EX,pm,bindex(g.first,exblk_ind),midvec,blap,false);
-					int niter_CFE_in = pm.niterCFE;
-					if (niter_CFE_in > GS.hblks[g.first].size/100) niter_CFE_in = GS.hblks[g.first].size/100;
-					if (niter_CFE_in < 20) niter_CFE_in = 20; 
-					cout << "Number of Lanczos Iteration: " << niter_CFE_in << endl;
-					ContFracExpan(GS.hblks[g.first].ham,midvec,gs_en,rixs_em_local,rixs_peaks_local,
-									pm.eps_loss,niter_CFE_in);
 				}
+				// De-excitation
+				emission(ab_en,midvecs,rixs_em_local,rixs_peaks_local);
 			}
 			bool write_init = (ab_en == pm.inc_e_points[0]);
 			// Write per absorption to save progress
@@ -702,39 +1011,27 @@ void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm) {
 				"RIXS_"+pm.edge+"edge_"+pol_str(pm.pvin)+"_"+pol_str(pm.pvout)+".txt",write_init);
 			cout << "---------------Done---------------" << endl;
 		}
+		if (pm.save_cfe) write_cfe(cfes,"RIXS_"+pm.edge+"edge_"+pol_str(pm.pvin)+"_"+pol_str(pm.pvout)+".cfe");
 	} else {
 		// Figure out energy levels for excited states within the spectra range
 		rixs_em = vecd(nedos,0);
 		rixs_ab = vecd(nedos,0);
 		rixs_peaks = vecd(nedos*nedos,0);
+		// einrange is the index of the level in exen, -1 if outside of the window
 		vecd exen;
-		for (auto &exblk : EX.hblks) {
-			exblk.init_einrange();
-			for (int ei = 0; ei < exblk.nev; ++ei) {
-				if (exblk.eig[ei] < gs_en + ab_emin || exblk.eig[ei] > gs_en + ab_emax) {
-					exblk.einrange[ei] = -1;
+		for (auto &exblk : EX.hblks) exblk.init_einrange();
+		for (size_t u = 0; u < EX.level_count(); ++u) {
+			bool in_range = false;
+			for (auto &e : EX.level_states(u)) {
+				double en = EX.hblks[e.first].eig[e.second];
+				if (en < gs_en + ab_emin || en > gs_en + ab_emax) {
+					EX.hblks[e.first].einrange[e.second] = -1;
 					continue;
 				}
-				bool is_dup = false;
-				for (auto &ex : exen) {
-					if (abs(exblk.eig[ei] - ex) < TOL) {
-						is_dup = true;
-						break;
-					}
-				}
-				if (!is_dup) exen.push_back(exblk.eig[ei]);
+				EX.hblks[e.first].einrange[e.second] = exen.size();
+				in_range = true;
 			}
-		}
-
-		sort(exen.begin(),exen.end());
-		if (exen.size() > 1) { // Skip this if there are less than 1 excited state
-			for (auto &exblk : EX.hblks) {
-			#pragma omp parallel for shared(exblk)
-			for (size_t ei = 0; ei < exblk.nev; ++ei) {
-				if (exblk.einrange[ei] == -1) continue;
-				exblk.einrange[ei] = ed::binary_search(exen,exblk.eig[ei],std::greater<double>(),
-						[&](double a, double b){return abs(a-b) < TOL;});
-			}}
+			if (in_range) exen.push_back(EX.level_en[u]);
 		}
 		// Calculate K-H frequency range
 		int n_min = round((exen[0]-gs_en-2-ab_emin)/(ab_emax-ab_emin)*nedos);
@@ -751,31 +1048,31 @@ void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm) {
 		cout << "Calculating <v|D|i>" << endl;
 		for (auto &exblk : EX.hblks) {
 			size_t last_gs_block = gsi[0].first;
-			basis_overlap(GS,EX,bindex(last_gs_block,&exblk-&EX.hblks[0]),blap,pm);
+			basis_overlap(GS,EX,bindex(last_gs_block,&exblk-&EX.hblks[0]),blap,pm,false,cache);
 			for (auto &g : gsi) {
 				auto& gsblk = GS.hblks[g.first];
 				// ed::print_progress((&exblk-&EX.hblks[0])*gsi.size()+(&g-&gsi[0])+1,EX.hblks.size()*gsi.size());
 				if (!GS.SO_on && !EX.SO_on && gsblk.get_sz() != exblk.get_sz()) continue;
 				if (g.first != last_gs_block) {
-					basis_overlap(GS,EX,bindex(g.first,&exblk-&EX.hblks[0]),blap,pm);
+					basis_overlap(GS,EX,bindex(g.first,&exblk-&EX.hblks[0]),blap,pm,false,cache);
 					last_gs_block = g.first;
 				}	
 				int gs_num = (&g-&gsi[0]);
+				vecc dgs;
+				if (gsblk.compressed() || exblk.compressed()) dgs = project_dipole(gsblk,g.second,exblk.size,blap);
 				#pragma omp parallel for shared(rixskern) schedule(dynamic)
 				for (size_t ei = 0; ei < exblk.nev; ++ei) {
 					if (exblk.eig[ei]-gs_en < ab_emin || exblk.eig[ei]-gs_en > ab_emax) continue;
+					if (!GS.dipole_allowed(EX,g,bindex(&exblk-&EX.hblks[0],ei),dirr_in)) continue;
 					dcomp csvi = 0;
-					for (auto & b : blap) {
+					if (!dgs.empty()) exblk.for_nonzero(ei,[&](size_t e, double c){csvi += c * dgs[e];});
+					else for (auto & b : blap) {
 						size_t gsind = g.second*gsblk.size+b.g;
 						size_t exind = ei*exblk.size+b.e;
 						csvi +=  gsblk.eigvec[gsind] * exblk.eigvec[exind] * b.blap;
 					}
-					if (abs(csvi) > TOL) rixskern[gs_num*EX.hsize+ei+exblk.f_ind] += csvi;
-				}
-				// Conjugate the <v|D|i> first
-				#pragma omp parallel for shared(rixskern) schedule(dynamic)
-				for (size_t r = 0; r < rixskern.size(); r++) {
-					rixskern[r] = conj(rixskern[r]);
+					// Stored conjugated, once for every block
+					if (abs(csvi) > TOL) rixskern[gs_num*EX.hsize+ei+exblk.f_ind] += conj(csvi);
 				}
 			}
 		}
@@ -783,67 +1080,89 @@ void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm) {
 		// NEW IMPLEMENTATION
 		// Loop through final states, calculate <f|D|v><v|D|i>, add to spectra
 		cout << endl << "Calculating <f|D|v><v|D|i>" << endl;
-		double gamma_tol = 6*pm.eps_loss;
 		double freq_step = (ab_emax-ab_emin)/nedos;
 		for (auto &fsblk : GS.hblks) {
-		for (auto &exblk : EX.hblks) {
-			if (!GS.SO_on && !EX.SO_on && fsblk.get_sz() != exblk.get_sz()) continue; // Spin order blocks
-			cout << "FS blk: " << &fsblk-&GS.hblks[0] << ", EX blk: " << &exblk-&EX.hblks[0] << endl;
-			basis_overlap(GS,EX,bindex(&fsblk-&GS.hblks[0],&exblk-&EX.hblks[0]),blap,pm,true);
-			for (size_t fi = 0; fi < fsblk.nev; ++fi) {
+			size_t fsblk_ind = &fsblk-&GS.hblks[0];
+			// A pair f, i can couple through several EX blocks (Jz blocks, q = +-1), the amplitudes
+			// of all of them are added before |.|^2
+			vector<DipoleOp> fsblap(EX.hblks.size());
+			vector<size_t> exc;
+			size_t max_size = 0, tot_nev = 0;
+			for (auto &exblk : EX.hblks) {
+				size_t exblk_ind = &exblk-&EX.hblks[0];
+				if (!GS.SO_on && !EX.SO_on && fsblk.get_sz() != exblk.get_sz()) continue; // Spin order blocks
+				basis_overlap(GS,EX,bindex(fsblk_ind,exblk_ind),fsblap[exblk_ind],pm,true,cache);
+				if (!fsblap[exblk_ind].size()) continue;
+				cout << "FS blk: " << fsblk_ind << ", EX blk: " << exblk_ind << endl;
+				exc.push_back(exblk_ind);
+				max_size = max(max_size,exblk.size);
+				tot_nev += exblk.nev;
+			}
+			if (exc.empty()) continue;
+			// <f|D|v> is computed for chunks of final states, work arrays are kept near 64 MB
+			vector<size_t> fsn;
+			for (size_t fi = 0; fi < fsblk.nev; ++fi) if (fsblk.eig[fi]-gs_en <= pm.em_energy) fsn.push_back(fi);
+			size_t chunk = max(size_t(1),min(size_t(256),(size_t(1)<<23)/(2*(max_size+tot_nev)+fsblk.size)));
+			vector<vecc> tmat(EX.hblks.size());
+			for (size_t fc = 0; fc < fsn.size(); ++fc) {
+				size_t fi = fsn[fc];
 				// ed::print_progress((double)fi+1,(double)fsblk.nev);
-				vector<dcomp> fDv = vector<dcomp>(exblk.nev,0);
+				if (fc % chunk == 0) {
+					vector<size_t> fchunk(fsn.begin()+fc,fsn.begin()+min(fc+chunk,fsn.size()));
+					for (auto e : exc) tmat[e] = transition_matrix(EX.hblks[e],fsblk,fchunk,fsblap[e]);
+				}
 				double fs_en = fsblk.eig[fi];
-				if (fs_en-gs_en > pm.em_energy) continue;
-				// Calculate <f|D|v> for all v		
-				#pragma omp parallel for shared(fDv) schedule(dynamic)
-				for (size_t ei = 0; ei < exblk.nev; ++ei) {
-					if (exblk.einrange[ei] == -1) continue;
-					dcomp csvf = 0;
-					for (size_t b = 0; b < blap.size(); ++b) {
-						size_t fsind = fi*fsblk.size+blap[b].g;
-						size_t exind = ei*exblk.size+blap[b].e;
-						csvf +=  fsblk.eigvec[fsind] * exblk.eigvec[exind] * blap[b].blap;
+				// Calculate <f|D|v> for all v of every EX block
+				vector<vecc> fDv(EX.hblks.size());
+				for (auto e : exc) {
+					auto& exblk = EX.hblks[e];
+					fDv[e] = vecc(exblk.nev,0);
+					#pragma omp parallel for schedule(dynamic)
+					for (size_t ei = 0; ei < exblk.nev; ++ei) {
+						if (exblk.einrange[ei] == -1) continue;
+						if (!GS.dipole_allowed(EX,bindex(fsblk_ind,fi),bindex(e,ei),dirr_out)) continue;
+						fDv[e][ei] = tmat[e][(fc%chunk)*exblk.nev+ei];
 					}
-					fDv[ei] = csvf;
 				}
 				// Calculate sum <f|D|v><v|D|i> for a pair of f,i
 				for (auto& g : gsi) {
 					int gs_num = &g-&gsi[0];
-					// precompute <f|D|v><v|D|i> for all v		
-					vector<dcomp> fDvvDi = vector<dcomp>(exblk.nev,0);
-					#pragma omp parallel for shared(fDvvDi,fDv,rixskern) schedule(dynamic)
-					for (size_t ei = 0; ei < exblk.nev; ++ei) {
-						// RIXSKERN already conjugated
-						fDvvDi[ei] += fDv[ei] * rixskern[gs_num*EX.hsize+ei+exblk.f_ind];
+					vector<pair<double,dcomp>> poles;
+					vector<dcomp> csum(exen.size(),0);
+					for (auto e : exc) {
+						auto& exblk = EX.hblks[e];
+						// precompute <f|D|v><v|D|i> for all v		
+						vector<dcomp> fDvvDi = vector<dcomp>(exblk.nev,0);
+						#pragma omp parallel for shared(fDvvDi,fDv,rixskern) schedule(dynamic)
+						for (size_t ei = 0; ei < exblk.nev; ++ei) {
+							// RIXSKERN already conjugated
+							fDvvDi[ei] += fDv[e][ei] * rixskern[gs_num*EX.hsize+ei+exblk.f_ind];
+						}
+						if (pm.spec_solver == 2 || pm.spec_solver == 3) {
+							for (size_t ei = 0; ei < exblk.nev; ++ei) {
+								if (abs(fDvvDi[ei]) < TOL) continue;
+								poles.push_back({exblk.eig[ei]-gs_en,fDvvDi[ei]});
+							}
+						}
+						if (pm.spec_solver == 1 || pm.spec_solver == 3) {
+							for (size_t ei = 0; ei < exblk.nev; ++ei) {
+								if (exblk.einrange[ei] == -1) continue;
+								csum[exblk.einrange[ei]] += fDvvDi[ei];
+							}
+						}
 					}
 					// Sweep through absorption frequency
 					if (pm.spec_solver == 2 || pm.spec_solver == 3) {
 						int eloss_ind = floor((fs_en-gs_en-eloss_min)/(pm.em_energy-eloss_min)*nedos);
 						rixs_em_kh[eloss_ind] = fs_en-gs_en;
-						#pragma omp parallel for shared(rixs_peaks_kh)
-						for (size_t n = n_min; n < n_max; ++n) {
-							dcomp intensity = 0;
-							double omega_in = ab_emin + n*freq_step;
-							// #pragma omp parallel for reduction(+:intensity)
-							for (size_t ei = 0; ei < exblk.nev; ++ei) {
-								if (abs(fDvvDi[ei]) < TOL) continue;
-								// if (abs(omega_in-(exblk.eig[ei]-gs_en))>gamma_tol) continue; 
-								intensity += fDvvDi[ei]/(omega_in-(exblk.eig[ei]-gs_en)+igamma);
-							}
-							rixs_peaks_kh[eloss_ind*nedos+n] += exp(-beta*gs_en)*pow(abs(intensity),2);
-						}
+						vecc intensity = kh_amplitude(poles,ab_emin,freq_step,n_min,n_max,igamma.imag(),pm.kh_window);
+						for (size_t n = n_min; n < n_max; ++n) 
+							rixs_peaks_kh[eloss_ind*nedos+n] += exp(-beta*gs_en)*pow(abs(intensity[n-n_min]),2);
 					}
 					// Exact solution
 					if (pm.spec_solver == 1 || pm.spec_solver == 3) {
 						int eloss_ind = floor((fs_en-gs_en)/(pm.em_energy)*nedos);
 						rixs_em[eloss_ind] = fs_en-gs_en;
-						vector<dcomp> csum(exen.size(),0);
-						#pragma omp parallel for shared(fDvvDi,csum)
-						for (size_t ei = 0; ei < exblk.nev; ++ei) {
-							if (exblk.einrange[ei] == -1) continue;
-							csum[exblk.einrange[ei]] += fDvvDi[ei];
-						}
 						#pragma omp parallel for shared(rixs_ab,rixs_peaks)
 						for (size_t e = 0; e < exen.size(); e++) {
 							if (abs(csum[e]) < TOL) continue;
@@ -855,7 +1174,7 @@ void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm) {
 					}
 				}
 			}
-		}}
+		}
 	}
 
 	auto stop = chrono::high_resolution_clock::now();
@@ -875,4 +1194,30 @@ void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm) {
 	} 
 
 	return;
+}
+
+void RIXS_from_cfe(const PM& pm) {
+	// Solver 4 RIXS from the saved loss step Lanczos coefficients. The incident energies and EPSAB 
+	// are those of the saved run, they enter the intermediate states
+	string fname = "RIXS_"+pm.edge+"edge_"+pol_str(pm.pvin)+"_"+pol_str(pm.pvout);
+	vector<CFECoef> cfes = read_cfe(fname+".cfe");
+	auto start = chrono::high_resolution_clock::now();
+	int nedos = pm.nedos;
+	vecd rixs_em(nedos,0), inc_en;
+	vector<vecd> rixs_peaks;
+	for (int i = 0; i < nedos; ++i) rixs_em[i] = -2 + (pm.em_energy+2)/nedos*i;
+	for (auto& cf : cfes) {
+		size_t k = find(inc_en.begin(),inc_en.end(),cf.inc_en) - inc_en.begin();
+		if (k == inc_en.size()) {
+			inc_en.push_back(cf.inc_en);
+			rixs_peaks.push_back(vecd(nedos,0));
+		}
+		cfe_spectrum(cf,rixs_em,rixs_peaks[k],pm.eps_loss);
+	}
+	auto stop = chrono::high_resolution_clock::now();
+	auto duration = chrono::duration_cast<chrono::milliseconds>(stop - start);
+	cout << "Spectrum from " << cfes.size() << " Lanczos runs, run time = " << duration.count() << " ms\n";
+	for (size_t k = 0; k < inc_en.size(); ++k)
+		write_iter_RIXS(vecd(nedos,inc_en[k]),rixs_em,rixs_peaks[k],fname+".txt",k == 0);
+	return;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <vector>
 #include <complex>
 #include <chrono>
+#include <map>
 #include "hilbert.hpp"
 #ifndef PHOTON
 #define PHOTON
@@ -17,9 +18,19 @@ struct PM {
 	double CG_tol = 1e-8;
 	int spec_solver = 1; // 1 = exact, 2 = Classic K-H, 3 = both, 4 Lanczos/BiCGS
 	int precond = 0; // 0 = no preconditioner, 1 = supply initial guess from last incident e
+	bool multi_shift = false; // Solver 4 solves all incident energies with one shifted COCG per block,
+							  // needs 2 complex vectors of the block and one of the core-hole space per
+							  // incident energy, larger grids are solved in groups that fit in a quarter 
+							  // of the memory
+	int mid_solver = 0; // Solver 4 intermediate state, 0 = BiCGS, 1 = COCG, 2 = COCR
+	bool save_cfe = false; // Solver 4 saves the Lanczos coefficients of every spectrum to *.cfe
+	bool respec = false; // Rebuild solver 4 spectra from the *.cfe files, no Hamiltonian is built
+	int kpm = 0; // Solver 4 spectra from this many Chebyshev moments (KPM) instead of continued fractions
+	int kpm_kernel = 0; // 0 = Jackson, 1 = Lorentz
 	double em_energy = 15;
 	double gamma = 0.3;
 	double eps_ab = 0.1, eps_loss = 0.1;
+	double kh_window = 0; // K-H poles beyond kh_window*eps_loss of the incident energy are binned, 0: all exact
 	double abmax = -1;
 	std::string edge;
 	std::vector<double> pvin, pvout, ab_range;
@@ -87,6 +98,29 @@ struct blapIndex {
 	blapIndex(): g(0), e(0), blap(dcomp(0,0)) {};
 };
 
+struct blapQIndex {
+	size_t g;
+	size_t e;
+	double amp; // <e|D_q|g> without the polarization
+	int q;		// Spherical component, -1, 0, 1
+	blapQIndex(size_t _g, size_t _e, double _amp, int _q): g(_g), e(_e), amp(_amp), q(_q) {};
+};
+
+// Polarization independent dipole operators of each (GS block, EX block) pair, kept between 
+// polarizations
+typedef std::map<bindex,std::vector<blapQIndex>> DipoleCache;
+
+struct DipoleOp {
+	// Sparse <e|D|g> between a GS and an EX block. Entries are sorted by GS state, row g is
+	// [gptr[g],gptr[g+1]). eord lists the entries by EX state, row e is eord[eptr[e]:eptr[e+1]]
+	std::vector<blapIndex> blap;
+	std::vector<size_t> gptr, eptr, eord;
+	size_t size() const {return blap.size();};
+	const blapIndex& operator[](size_t k) const {return blap[k];};
+	std::vector<blapIndex>::const_iterator begin() const {return blap.begin();};
+	std::vector<blapIndex>::const_iterator end() const {return blap.end();};
+};
+
 std::string pol_str(const vecd& pvec);
 std::complex<double> proj_pvec(int ml, const vecd& pvec);
 vecd occupation(Hilbert& hilbs, const std::vector<bindex>& si, bool is_print=true, 
@@ -95,14 +129,23 @@ vecd wvfnc_weight(Hilbert& hilbs, const std::vector<bindex>& si,
 								int ligNum = 3, bool print = false);
 double effective_delta(Hilbert& hilbs, int ligNum = 3, bool is_print = false);
 void state_composition(Hilbert& hilbs, const std::vector<bindex>& si, size_t top = 10);
-void basis_overlap(Hilbert& GS, Hilbert& EX, bindex inds, std::vector<blapIndex>& blap, 
-					const PM& pm, bool pvout = false);
+double dipole_qamp(Hilbert& GS, Hilbert& EX, ulli ch, ulli vh, int& q);
+std::complex<double> dipole_amp(Hilbert& GS, Hilbert& EX, ulli ch, ulli vh, const vecd& pvec);
+std::vector<blapQIndex> dipole_components(Hilbert& GS, Hilbert& EX, bindex inds);
+void basis_overlap(Hilbert& GS, Hilbert& EX, bindex inds, DipoleOp& blap, 
+					const PM& pm, bool pvout = false, DipoleCache* cache = nullptr);
+vecc project_dipole(const Block<double>& blk, size_t n, size_t exblk_size, const DipoleOp& blap);
+void write_cfe(const std::vector<CFECoef>& cfes, std::string file_dir);
+std::vector<CFECoef> read_cfe(std::string file_dir);
 // XAS Functions
+vecc transition_matrix(const Block<double>& exblk, const Block<double>& gsblk, const std::vector<size_t>& gsn,
+						const DipoleOp& blap);
 void XAS_peak_occupation(Hilbert& GS, Hilbert& EX, vecd const& peak_en, vecd const& energy, 
 						vecd const& intensity, std::vector<bindex> const& gsi, double ref_en = 0, 
 						std::string mode = "list", bool ref_gs = false);
 void write_XAS(vecd const& aben, vecd const& intensity, std::string file_dir = "", bool exact=true);
-void XAS(Hilbert& GS, Hilbert& EX, const PM& pm);
+void XAS(Hilbert& GS, Hilbert& EX, const PM& pm, DipoleCache* cache = nullptr);
+void XAS_from_cfe(const PM& pm);
 
 // RIXS functions
 void RIXS_peak_occupation(Hilbert& GS, Hilbert& EX, vecd const& peak_en, vecd const& ab_en, 
@@ -110,8 +153,11 @@ void RIXS_peak_occupation(Hilbert& GS, Hilbert& EX, vecd const& peak_en, vecd co
 						PM const& pm, double ref_en = 0, std::string mode = "list", bool ref_gs = false);
 void write_RIXS(vecd const& peaks, vecd const& ab, vecd const& em, bool eloss, 
 				std::string file_dir = "");
-void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm);
+vecc kh_amplitude(std::vector<std::pair<double,dcomp>> poles, double omega0, double step, size_t n_min, 
+					size_t n_max, double gamma, double window = 0);
+void RIXS(Hilbert& GS, Hilbert& EX, const PM& pm, DipoleCache* cache = nullptr);
+void RIXS_from_cfe(const PM& pm);
 vecc gen_dipole_state(Hilbert& GS, Hilbert& EX, const PM& pm, const bindex& inds, vecc vec_in, 
-						const std::vector<blapIndex>& blap, bool excite = true);
+						const DipoleOp& blap, bool excite = true);
 
 #endif
\ No newline at end of file